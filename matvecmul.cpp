@@ -27,10 +27,57 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
 #include <iostream>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <linux/futex.h>
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <exception>
+#define HAVE_COROUTINES
+#endif
 #include <omp.h>
 #include <openacc.h>
 
+///////////////////////////////////////////////////////////////////////////////////////////////
+// Unique object ids, used to remember which vectors took part in the last product           //
+///////////////////////////////////////////////////////////////////////////////////////////////
+size_t newObjectId()
+{
+  static size_t counter = 0;
+  return ++counter;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// Graph capture hook, see task_graph and beginCapture()                                     //
+///////////////////////////////////////////////////////////////////////////////////////////////
+struct matrix;
+struct vector;
+
+enum task_kind { TASK_INIT, TASK_INIT_MATRIX, TASK_COPY, TASK_SCAL, TASK_AXPY, TASK_AXPBY,
+                 TASK_DOT, TASK_MATVEC };
+
+// true if the call was recorded into the graph being captured, or refused because it is
+// asynchronous (queue != acc_async_sync); either way the caller must not run it
+bool captured(task_kind kind, int queue, matrix * mat, vector * x, vector * y, vector * z,
+              float a = 0.0f, float b = 0.0f);
+
+// true, after reporting it, if a graph is being captured; op cannot be recorded
+bool captureRefused(const char * op);
+
+
 /**********************************************************************************************
 ** Matrix data structure                                                                     **
 ***********************************************************************************************
@@ -50,17 +97,36 @@
 **   specifies that the data transfer is device-to-host                                      **
 ** device clause:                                                                            **
 **   specifies that the data transfer is host-to-device                                      **
+** subarray update:                                                                          **
+**   data[start:length] moves only part of an array, e.g. a single modified row              **
 **********************************************************************************************/
 struct matrix
 {
 
   float * data;
   size_t nx, ny;
+  size_t id, version;
+
+  // host-only bookkeeping for matvecmul_incremental
+  bool * dirty;
+  int * dirtyRows;
+  int ndirty;
+  size_t lastMatVersion;
+  size_t lastVecId, lastVecVersion;
+  size_t lastOutId, lastOutVersion;
 
   matrix(int _nx, int _ny)
   {
     nx = _nx; ny = _ny;
+    id = newObjectId();
+    version = 0;
     data = new float[_nx*_ny];
+    dirty = new bool[_nx]();
+    dirtyRows = new int[_nx];
+    ndirty = 0;
+    lastMatVersion = 0;
+    lastVecId = lastVecVersion = 0;
+    lastOutId = lastOutVersion = 0;
     #pragma acc enter data copyin(this)
     #pragma acc enter data create(data[:_nx*_ny])
   }
@@ -71,6 +137,8 @@ struct matrix
     #pragma acc exit data delete(data)
     #pragma acc exit data delete(this)
     delete[] data;
+    delete[] dirty;
+    delete[] dirtyRows;
   }
 
   float& at(int x, int y)
@@ -78,14 +146,67 @@ struct matrix
     return data[x*ny + y];
   }
 
+  // host-side write access that remembers row x has changed
+  float& modify(int x, int y)
+  {
+    markDirty(x);
+    return at(x, y);
+  }
+
+  void markDirty(int x)
+  {
+    if(!dirty[x]) {
+      dirty[x] = true;
+      dirtyRows[ndirty++] = x;
+    }
+  }
+
+  void clearDirty()
+  {
+    for(int k = 0; k < ndirty; k++)
+      dirty[dirtyRows[k]] = false;
+    ndirty = 0;
+  }
+
   void updateCPU()
   {
+    if(captureRefused("matrix::updateCPU")) return;
     #pragma acc update self(data[:nx*ny])
   }
 
   void updateGPU()
   {
+    if(captureRefused("matrix::updateGPU")) return;
     #pragma acc update device(data[:nx*ny])
+    version++;
+    clearDirty();
+  }
+
+  // asynchronous versions, queued on the given async queue
+  void updateCPU(int queue)
+  {
+    if(captureRefused("matrix::updateCPU")) return;
+    #pragma acc update self(data[:nx*ny]) async(queue)
+  }
+
+  void updateGPU(int queue)
+  {
+    if(captureRefused("matrix::updateGPU")) return;
+    #pragma acc update device(data[:nx*ny]) async(queue)
+    version++;
+    clearDirty();
+  }
+
+  // pushes and clears the dirty rows; dirtyRows still lists them until the next markDirty
+  void updateGPURows()
+  {
+    if(captureRefused("matrix::updateGPURows")) return;
+    for(int k = 0; k < ndirty; k++) {
+      int x = dirtyRows[k];
+      #pragma acc update device(data[x*ny:ny])
+    }
+    if(ndirty > 0) version++;
+    clearDirty();
   }
 
 };
@@ -98,21 +219,38 @@ struct vector
 
   float * data;
   size_t n;
+  size_t id, version;
+  bool owner;
 
   vector(int _n)
   {
     n = _n;
+    id = newObjectId();
+    version = 0;
+    owner = true;
     data = new float[_n];
     #pragma acc enter data copyin(this)
     #pragma acc enter data create(data[:_n])
   }
 
+  // a view of host memory owned by someone else, e.g. a shared memory slot
+  vector(float * _data, int _n)
+  {
+    n = _n;
+    id = newObjectId();
+    version = 0;
+    owner = false;
+    data = _data;
+    #pragma acc enter data copyin(this)
+    #pragma acc enter data create(data[:_n])
+  }
+
   ~vector()
   {
     n = 0;
     #pragma acc exit data delete(data)
     #pragma acc exit data delete(this)
-    delete[] data;
+    if(owner) delete[] data;
   }
 
   float& at(int i)
@@ -122,12 +260,29 @@ struct vector
 
   void updateCPU()
   {
+    if(captureRefused("vector::updateCPU")) return;
     #pragma acc update self(data[:n])
   }
 
   void updateGPU()
   {
+    if(captureRefused("vector::updateGPU")) return;
     #pragma acc update device(data[:n])
+    version++;
+  }
+
+  // asynchronous versions, queued on the given async queue
+  void updateCPU(int queue)
+  {
+    if(captureRefused("vector::updateCPU")) return;
+    #pragma acc update self(data[:n]) async(queue)
+  }
+
+  void updateGPU(int queue)
+  {
+    if(captureRefused("vector::updateGPU")) return;
+    #pragma acc update device(data[:n]) async(queue)
+    version++;
   }
 
 };
@@ -146,21 +301,137 @@ struct vector
 ** present clause:                                                                           **
 **   data clause that specifies data that is already allocated on the accelerator            **
 **********************************************************************************************/
-void init(matrix & mat, float val)
+void init(matrix & mat, float val, int queue = acc_async_sync)
 {
+  if(captured(TASK_INIT_MATRIX, queue, &mat, NULL, NULL, NULL, val)) return;
 #pragma acc parallel loop collapse(2) \
- present(mat)
+ present(mat) \
+ async(queue)
   for(int i = 0; i < mat.nx; i++)
     for(int j = 0; j < mat.ny; j++)
       mat.at(i, j) = val;
+  mat.version++;
 }
 
-void init(vector & vec, float val)
+void init(vector & vec, float val, int queue = acc_async_sync)
 {
+  if(captured(TASK_INIT, queue, NULL, NULL, &vec, NULL, val)) return;
 #pragma acc parallel loop \
- present(vec)
+ present(vec) \
+ async(queue)
   for(int i = 0; i < vec.n; i++)
     vec.at(i) = val;
+  vec.version++;
+}
+
+
+/**********************************************************************************************
+** Level-1 vector kernels                                                                    **
+***********************************************************************************************
+** The usual BLAS names: y = x, x = a*x, y = a*x + y, y = a*x + b*y, x.y and ||x||.          **
+** reduction clause on a parallel loop:                                                      **
+**   every parallel unit accumulates a partial result, which are combined at the end of the  **
+**   loop and copied back to the host variable                                               **
+** dot_nrm2 computes x.y and ||x|| with two reductions in the same loop, reading x once.     **
+** async clause with acc_async_sync:                                                         **
+**   the default queue argument, which makes the kernel synchronous                          **
+**********************************************************************************************/
+bool compatible(vector & x, vector & y)
+{
+  if(x.n != y.n) {
+    std::cerr << "vector dimensions incompatible" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void copy(vector & x, vector & y, int queue = acc_async_sync)
+{
+  if(!compatible(x, y)) return;
+  if(captured(TASK_COPY, queue, NULL, &x, &y, NULL)) return;
+#pragma acc parallel loop \
+ present(x, y) \
+ async(queue)
+  for(int i = 0; i < x.n; i++)
+    y.at(i) = x.at(i);
+  y.version++;
+}
+
+void scal(float a, vector & x, int queue = acc_async_sync)
+{
+  if(captured(TASK_SCAL, queue, NULL, NULL, &x, NULL, a)) return;
+#pragma acc parallel loop \
+ present(x) \
+ async(queue)
+  for(int i = 0; i < x.n; i++)
+    x.at(i) *= a;
+  x.version++;
+}
+
+void axpy(float a, vector & x, vector & y, int queue = acc_async_sync)
+{
+  if(!compatible(x, y)) return;
+  if(captured(TASK_AXPY, queue, NULL, &x, &y, NULL, a)) return;
+#pragma acc parallel loop \
+ present(x, y) \
+ async(queue)
+  for(int i = 0; i < x.n; i++)
+    y.at(i) += a*x.at(i);
+  y.version++;
+}
+
+void axpby(float a, vector & x, float b, vector & y, int queue = acc_async_sync)
+{
+  if(!compatible(x, y)) return;
+  if(captured(TASK_AXPBY, queue, NULL, &x, &y, NULL, a, b)) return;
+#pragma acc parallel loop \
+ present(x, y) \
+ async(queue)
+  for(int i = 0; i < x.n; i++)
+    y.at(i) = a*x.at(i) + b*y.at(i);
+  y.version++;
+}
+
+float dot(vector & x, vector & y)
+{
+  if(captureRefused("dot")) return 0.0f;
+  if(!compatible(x, y)) return 0.0f;
+  float sum = 0.0f;
+#pragma acc parallel loop \
+ present(x, y) \
+ reduction(+:sum)
+  for(int i = 0; i < x.n; i++)
+    sum += x.at(i)*y.at(i);
+  return sum;
+}
+
+float nrm2(vector & x)
+{
+  if(captureRefused("nrm2")) return 0.0f;
+  float sum = 0.0f;
+#pragma acc parallel loop \
+ present(x) \
+ reduction(+:sum)
+  for(int i = 0; i < x.n; i++)
+    sum += x.at(i)*x.at(i);
+  return sqrtf(sum);
+}
+
+void dot_nrm2(vector & x, vector & y, float & xy, float & xnorm)
+{
+  xy = 0.0f; xnorm = 0.0f;
+  if(captureRefused("dot_nrm2")) return;
+  if(!compatible(x, y)) return;
+  float sum = 0.0f, sq = 0.0f;
+#pragma acc parallel loop \
+ present(x, y) \
+ reduction(+:sum,sq)
+  for(int i = 0; i < x.n; i++) {
+    float xi = x.at(i);
+    sum += xi*y.at(i);
+    sq += xi*xi;
+  }
+  xy = sum; xnorm = sqrtf(sq);
 }
 
 
@@ -179,19 +450,29 @@ void init(vector & vec, float val)
 **   identifies SIMD operations. Some multicore CPUs and not take advantage of this, unless  **
 **   it supports SIMD instructions. For GPUs, this would represent a single thread.          **
 **********************************************************************************************/
-void matvecmul(matrix & mat, vector & vec, vector & out)
+void recordProduct(matrix & mat, vector & vec, vector & out)
+{
+  out.version++;
+  mat.lastMatVersion = mat.version;
+  mat.lastVecId = vec.id; mat.lastVecVersion = vec.version;
+  mat.lastOutId = out.id; mat.lastOutVersion = out.version;
+}
+
+void matvecmul(matrix & mat, vector & vec, vector & out, int queue = acc_async_sync)
 {
   if(mat.ny != vec.n || mat.nx != out.n) {
     std::cerr << "matrix/vector dimensions incompatible" << std::endl;
     return;
   }
+  if(captured(TASK_MATVEC, queue, &mat, &vec, &out, NULL)) return;
 
   int i, j;
   float sum;
 
 #pragma acc parallel loop gang \
  present(mat, vec, out) \
- private(sum)
+ private(sum) \
+ async(queue)
   for ( i = 0 ; i < mat.nx ; i++ ) {
     sum = 0.0f;
 #pragma acc loop vector reduction(+:sum)
@@ -201,54 +482,5012 @@ void matvecmul(matrix & mat, vector & vec, vector & out)
     out.at(i) = sum;
   }
 
+  recordProduct(mat, vec, out);
 }
 
 
-///////////////////////////////////////////////////////////////////////////////////////////////
-// Automated correctness checking                                                            //
-///////////////////////////////////////////////////////////////////////////////////////////////
-void check(matrix & mat, const char * name, const char * filename,
-           const char * functionname, int linenum)
+/**********************************************************************************************
+** Matrix-Matrix multiply computation                                                        **
+***********************************************************************************************
+** C = alpha*A*B + beta*C                                                                    **
+** Blocked: each gang owns a GEMM_TILE x GEMM_TILE tile of C and walks k in steps of         **
+** GEMM_KB. For every step it stages the A panel (TILE x KB) and the B panel (KB x TILE) in  **
+** arrays declared inside the gang loop, which are gang-private (shared memory on a GPU),    **
+** and its vector lanes update the tile from those copies. Every element of A and B is then  **
+** read from main memory once per tile instead of once per element of C, and the partial     **
+** sums stay in the gang's C tile until the last k step.                                     **
+** Calling matvecmul once per column of B would instead read all of A for every column.      **
+**********************************************************************************************/
+#define GEMM_TILE 32
+#define GEMM_KB 32
+
+void gemm(float alpha, matrix & A, matrix & B, float beta, matrix & C)
 {
-#ifdef DEBUG
-  mat.updateCPU();
-  pgi_compare(mat.data, "float", mat.nx*mat.ny, name, filename, functionname, linenum);
-#endif
+  if(captureRefused("gemm")) return;
+  if(A.ny != B.nx || C.nx != A.nx || C.ny != B.ny) {
+    std::cerr << "matrix dimensions incompatible" << std::endl;
+    return;
+  }
+
+  int nx = C.nx, ny = C.ny, nk = A.ny;
+  int tilesX = (nx + GEMM_TILE - 1) / GEMM_TILE;
+  int tilesY = (ny + GEMM_TILE - 1) / GEMM_TILE;
+  int bi, bj, k0, ii, jj, kk;
+
+#pragma acc parallel loop gang collapse(2) \
+ present(A, B, C)
+  for ( bi = 0 ; bi < tilesX ; bi++ ) {
+    for ( bj = 0 ; bj < tilesY ; bj++ ) {
+      float Ap[GEMM_TILE][GEMM_KB];
+      float Bp[GEMM_KB][GEMM_TILE];
+      float Ct[GEMM_TILE][GEMM_TILE];
+      int i0 = bi*GEMM_TILE, j0 = bj*GEMM_TILE;
+
+#pragma acc loop vector collapse(2)
+      for ( ii = 0 ; ii < GEMM_TILE ; ii++ )
+        for ( jj = 0 ; jj < GEMM_TILE ; jj++ )
+          Ct[ii][jj] = 0.0f;
+
+#pragma acc loop seq
+      for ( k0 = 0 ; k0 < nk ; k0 += GEMM_KB ) {
+#pragma acc loop vector collapse(2)
+        for ( ii = 0 ; ii < GEMM_TILE ; ii++ )
+          for ( kk = 0 ; kk < GEMM_KB ; kk++ )
+            Ap[ii][kk] = i0 + ii < nx && k0 + kk < nk ? A.at(i0 + ii, k0 + kk) : 0.0f;
+#pragma acc loop vector collapse(2)
+        for ( kk = 0 ; kk < GEMM_KB ; kk++ )
+          for ( jj = 0 ; jj < GEMM_TILE ; jj++ )
+            Bp[kk][jj] = k0 + kk < nk && j0 + jj < ny ? B.at(k0 + kk, j0 + jj) : 0.0f;
+
+#pragma acc loop vector collapse(2)
+        for ( ii = 0 ; ii < GEMM_TILE ; ii++ ) {
+          for ( jj = 0 ; jj < GEMM_TILE ; jj++ ) {
+            float sum = Ct[ii][jj];
+            for ( kk = 0 ; kk < GEMM_KB ; kk++ ) {
+              sum += Ap[ii][kk]*Bp[kk][jj];
+            }
+            Ct[ii][jj] = sum;
+          }
+        }
+      }
+
+#pragma acc loop vector collapse(2)
+      for ( ii = 0 ; ii < GEMM_TILE ; ii++ )
+        for ( jj = 0 ; jj < GEMM_TILE ; jj++ )
+          if(i0 + ii < nx && j0 + jj < ny)
+            C.at(i0 + ii, j0 + jj) = alpha*Ct[ii][jj] + beta*C.at(i0 + ii, j0 + jj);
+    }
+  }
+
+  C.version++;
 }
 
-void check(vector & vec, const char * name, const char * filename,
-           const char * functionname, int linenum)
+void transpose(matrix & A, matrix & At)
 {
-#ifdef DEBUG
-  vec.updateCPU();
-  pgi_compare(vec.data, "float", vec.n, name, filename, functionname, linenum);
-#endif
+  if(captureRefused("transpose")) return;
+  if(At.nx != A.ny || At.ny != A.nx) {
+    std::cerr << "matrix dimensions incompatible" << std::endl;
+    return;
+  }
+
+#pragma acc parallel loop collapse(2) \
+ present(A, At)
+  for(int i = 0; i < A.nx; i++)
+    for(int j = 0; j < A.ny; j++)
+      At.at(j, i) = A.at(i, j);
+  At.version++;
 }
 
 
 /**********************************************************************************************
-** Main                                                                                      **
+** Rank-1 and rank-k updates                                                                 **
 ***********************************************************************************************
-** Important steps:                                                                          **
-**   Device-aware memory allocation                                                          **
-**   Device computation                                                                      **
-**   Correctness testing                                                                     **
+** ger:        A = A + alpha*x*y^T                                                           **
+** syrk:       C = alpha*A*A^T + beta*C (all of C is written, not only one triangle)         **
+** matvecmul_ger: out = A*vec with the old A, then A = A + alpha*x*y^T, in a single sweep    **
+** These use the same gang-per-row, vector-per-column split as matvecmul, so each gang       **
+** touches the same rows of A in every kernel.                                               **
 **********************************************************************************************/
-int main()
+void ger(float alpha, vector & x, vector & y, matrix & A)
 {
+  if(captureRefused("ger")) return;
+  if(A.nx != x.n || A.ny != y.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
 
-  matrix mat(128, 256);
-  vector vec(256);
-  vector out(128);
+  int i, j;
+  float ax;
 
-  init(mat, 1.0f);
-  init(vec, 2.0f);
+#pragma acc parallel loop gang \
+ present(A, x, y) \
+ private(ax)
+  for ( i = 0 ; i < A.nx ; i++ ) {
+    ax = alpha*x.at(i);
+#pragma acc loop vector
+    for ( j = 0 ; j < A.ny ; j++ ) {
+      A.at(i,j) += ax*y.at(j);
+    }
+  }
 
-  matvecmul(mat, vec, out);
+  A.version++;
+}
 
-  check(mat, "mat", "OpenACCExample.cpp", "main", 1);
-  check(vec, "vec", "OpenACCExample.cpp", "main", 2);
-  check(out, "out", "OpenACCExample.cpp", "main", 3);
+void syrk(float alpha, matrix & A, float beta, matrix & C)
+{
+  if(captureRefused("syrk")) return;
+  if(C.nx != A.nx || C.ny != A.nx) {
+    std::cerr << "matrix dimensions incompatible" << std::endl;
+    return;
+  }
+
+  int i, j, k;
+  float sum;
+
+#pragma acc parallel loop gang \
+ present(A, C)
+  for ( i = 0 ; i < C.nx ; i++ ) {
+#pragma acc loop vector private(sum)
+    for ( j = 0 ; j < C.ny ; j++ ) {
+      sum = 0.0f;
+      for ( k = 0 ; k < A.ny ; k++ ) {
+        sum += A.at(i,k)*A.at(j,k);
+      }
+      C.at(i,j) = alpha*sum + beta*C.at(i,j);
+    }
+  }
+
+  C.version++;
+}
+
+void matvecmul_ger(matrix & mat, vector & vec, vector & out,
+                   float alpha, vector & x, vector & y)
+{
+  if(captureRefused("matvecmul_ger")) return;
+  if(mat.ny != vec.n || mat.nx != out.n || mat.nx != x.n || mat.ny != y.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  int i, j;
+  float sum, ax;
+
+#pragma acc parallel loop gang \
+ present(mat, vec, out, x, y) \
+ private(sum, ax)
+  for ( i = 0 ; i < mat.nx ; i++ ) {
+    sum = 0.0f;
+#pragma acc loop vector reduction(+:sum)
+    for ( j = 0 ; j < mat.ny ; j++ ) {
+      sum += mat.at(i,j)*vec.at(j);
+    }
+    out.at(i) = sum;
+    ax = alpha*x.at(i);
+#pragma acc loop vector
+    for ( j = 0 ; j < mat.ny ; j++ ) {
+      mat.at(i,j) += ax*y.at(j);
+    }
+  }
+
+  out.version++;
+  mat.version++;
+}
+
+
+/**********************************************************************************************
+** Row-incremental Matrix-Vector multiply                                                    **
+***********************************************************************************************
+** If vec and out are untouched since the last product with mat, only the rows changed       **
+** through mat.modify() need recomputing. Those rows are pushed to the device with subarray  **
+** updates instead of a full updateGPU().                                                    **
+** copyin clause on a compute construct:                                                     **
+**   the list of dirty rows is copied to the device for the duration of the loop only        **
+**********************************************************************************************/
+void matvecmul_incremental(matrix & mat, vector & vec, vector & out)
+{
+  if(captureRefused("matvecmul_incremental")) return;
+  if(mat.ny != vec.n || mat.nx != out.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  bool upToDate = mat.lastMatVersion == mat.version &&
+    mat.lastVecId == vec.id && mat.lastVecVersion == vec.version &&
+    mat.lastOutId == out.id && mat.lastOutVersion == out.version;
+
+  int * rows = mat.dirtyRows;
+  int nrows = mat.ndirty;
+
+  mat.updateGPURows();
+
+  if(!upToDate) {
+    matvecmul(mat, vec, out);
+    return;
+  }
+
+  if(nrows == 0) return;
+
+  int k, j;
+  float sum;
+
+#pragma acc parallel loop gang \
+ present(mat, vec, out) \
+ copyin(rows[:nrows]) \
+ private(sum)
+  for ( k = 0 ; k < nrows ; k++ ) {
+    int i = rows[k];
+    sum = 0.0f;
+#pragma acc loop vector reduction(+:sum)
+    for ( j = 0 ; j < mat.ny ; j++ ) {
+      sum += mat.at(i,j)*vec.at(j);
+    }
+    out.at(i) = sum;
+  }
+
+  recordProduct(mat, vec, out);
+}
+
+
+/**********************************************************************************************
+** Matrix-Vector result cache                                                                **
+***********************************************************************************************
+** Versions count changes to the device copy of a matrix or vector (init, updateGPU and      **
+** kernels writing to it), so host writes through at() count once they are pushed with       **
+** updateGPU(). A product whose (mat, vec) ids and versions match a cached entry is served   **
+** by an O(nx) device copy instead of an O(nx*ny) matvecmul. The cache owns device copies    **
+** of its results, so it stays valid even if the original out vector is destroyed.           **
+**********************************************************************************************/
+struct matvec_cache
+{
+
+  static const int size = 4;
+
+  struct entry
+  {
+    vector * result;
+    size_t matId, matVersion;
+    size_t vecId, vecVersion;
+    size_t outId, outVersion;
+  };
+
+  entry entries[size];
+  int next;
+  size_t hits, misses;
+
+  matvec_cache()
+  {
+    for(int k = 0; k < size; k++) {
+      entries[k].result = NULL;
+      entries[k].matId = entries[k].vecId = entries[k].outId = 0;
+    }
+    next = 0;
+    hits = misses = 0;
+  }
 
+  ~matvec_cache()
+  {
+    for(int k = 0; k < size; k++)
+      delete entries[k].result;
+  }
+
+};
+
+void matvecmul_cached(matvec_cache & cache, matrix & mat, vector & vec, vector & out)
+{
+  if(captureRefused("matvecmul_cached")) return;
+  if(mat.ny != vec.n || mat.nx != out.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  for(int k = 0; k < matvec_cache::size; k++) {
+    matvec_cache::entry & e = cache.entries[k];
+    if(e.result == NULL || e.matId != mat.id || e.matVersion != mat.version ||
+       e.vecId != vec.id || e.vecVersion != vec.version)
+      continue;
+    // out may already hold exactly this result
+    if(e.outId != out.id || e.outVersion != out.version) {
+      copy(*e.result, out);
+      e.outId = out.id; e.outVersion = out.version;
+    }
+    cache.hits++;
+    return;
+  }
+
+  matvecmul(mat, vec, out);
+  cache.misses++;
+
+  matvec_cache::entry & e = cache.entries[cache.next];
+  cache.next = (cache.next + 1) % matvec_cache::size;
+  if(e.result == NULL || e.result->n != out.n) {
+    delete e.result;
+    e.result = new vector(out.n);
+  }
+  copy(out, *e.result);
+  e.matId = mat.id; e.matVersion = mat.version;
+  e.vecId = vec.id; e.vecVersion = vec.version;
+  e.outId = out.id; e.outVersion = out.version;
 }
 
+
+/**********************************************************************************************
+** Lazy vector expressions                                                                   **
+***********************************************************************************************
+** Chains like clamp(2.0f*a + b, 0.0f, 1.0f) build a small expression object instead of      **
+** running one parallel loop per operation into temporary vectors. Nothing is computed       **
+** until the expression is consumed, either by assign() (one materializing loop) or by       **
+** matvecmul(), which evaluates it directly in place of the vec.at(j) load.                  **
+** acc_deviceptr:                                                                            **
+**   returns the device address of present data. leaves store it so the expression can be    **
+**   passed by value into a compute region                                                   **
+** firstprivate clause:                                                                      **
+**   each parallel unit gets a copy of the value as it was on entry to the region            **
+**********************************************************************************************/
+// size of a node whose operands differ in length; assign() and matvecmul() reject it
+#define VEXPR_MISMATCH ((size_t) -1)
+
+inline size_t commonSize(size_t a, size_t b) { return a == b ? a : VEXPR_MISMATCH; }
+
+template <class E>
+struct vexpr
+{
+  const E& self() const { return static_cast<const E&>(*this); }
+};
+
+struct vref : vexpr<vref>
+{
+  const float * d;
+  size_t n;
+
+  vref(vector & vec)
+  {
+    d = (const float *) acc_deviceptr(vec.data);
+    n = vec.n;
+  }
+
+  float operator()(int i) const { return d[i]; }
+  size_t size() const { return n; }
+};
+
+template <class L, class R>
+struct vadd : vexpr< vadd<L, R> >
+{
+  L l; R r;
+  vadd(const L& _l, const R& _r) : l(_l), r(_r) {}
+  float operator()(int i) const { return l(i) + r(i); }
+  size_t size() const { return commonSize(l.size(), r.size()); }
+};
+
+template <class L, class R>
+struct vmul : vexpr< vmul<L, R> >
+{
+  L l; R r;
+  vmul(const L& _l, const R& _r) : l(_l), r(_r) {}
+  float operator()(int i) const { return l(i) * r(i); }
+  size_t size() const { return commonSize(l.size(), r.size()); }
+};
+
+template <class E>
+struct vscale : vexpr< vscale<E> >
+{
+  float a; E e;
+  vscale(float _a, const E& _e) : a(_a), e(_e) {}
+  float operator()(int i) const { return a * e(i); }
+  size_t size() const { return e.size(); }
+};
+
+template <class E>
+struct vclamp : vexpr< vclamp<E> >
+{
+  E e; float lo, hi;
+  vclamp(const E& _e, float _lo, float _hi) : e(_e), lo(_lo), hi(_hi) {}
+  float operator()(int i) const
+  {
+    float v = e(i);
+    return v < lo ? lo : (v > hi ? hi : v);
+  }
+  size_t size() const { return e.size(); }
+};
+
+inline vref lazy(vector & vec) { return vref(vec); }
+
+template <class L, class R>
+vadd<L, R> operator+(const vexpr<L>& l, const vexpr<R>& r)
+{ return vadd<L, R>(l.self(), r.self()); }
+
+template <class L, class R>
+vmul<L, R> operator*(const vexpr<L>& l, const vexpr<R>& r)
+{ return vmul<L, R>(l.self(), r.self()); }
+
+template <class E>
+vscale<E> operator*(float a, const vexpr<E>& e)
+{ return vscale<E>(a, e.self()); }
+
+template <class E>
+vclamp<E> clamp(const vexpr<E>& e, float lo, float hi)
+{ return vclamp<E>(e.self(), lo, hi); }
+
+template <class E>
+void assign(vector & out, const vexpr<E>& expr)
+{
+  if(captureRefused("assign")) return;
+  const E ex = expr.self();
+  if(ex.size() != out.n) {
+    std::cerr << "vector expression size incompatible" << std::endl;
+    return;
+  }
+
+#pragma acc parallel loop \
+ present(out) \
+ firstprivate(ex)
+  for(int i = 0; i < out.n; i++)
+    out.at(i) = ex(i);
+  out.version++;
+}
+
+// Fused form: the expression is re-evaluated per row, which trades a few flops for never
+// writing or re-reading a temporary vector.
+template <class E>
+void matvecmul(matrix & mat, const vexpr<E>& vec, vector & out)
+{
+  if(captureRefused("matvecmul of an expression")) return;
+  const E ex = vec.self();
+  if(mat.ny != ex.size() || mat.nx != out.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  int i, j;
+  float sum;
+
+#pragma acc parallel loop gang \
+ present(mat, out) \
+ firstprivate(ex) \
+ private(sum)
+  for ( i = 0 ; i < mat.nx ; i++ ) {
+    sum = 0.0f;
+#pragma acc loop vector reduction(+:sum)
+    for ( j = 0 ; j < mat.ny ; j++ ) {
+      sum += mat.at(i,j)*ex(j);
+    }
+    out.at(i) = sum;
+  }
+
+  out.version++;
+}
+
+
+/**********************************************************************************************
+** Low-rank factored matrix                                                                  **
+***********************************************************************************************
+** Stores A ~ U*Vt (+ diag(d)) with U nx x k and Vt k x ny, so a product costs               **
+** k*(nx+ny) instead of nx*ny: t = Vt*x followed by out = U*t, two ordinary matvecmuls.      **
+** rsvd() builds the factors from a dense matrix with a randomized range finder:             **
+**   Y = A*Omega for a Gaussian Omega, optional power iterations Y = A*(At*Y),               **
+**   U = orthonormalized Y, Vt = Ut*A                                                        **
+** The orthonormalization of the thin nx x k matrix Y is done on the host.                   **
+**********************************************************************************************/
+struct lowrank_matrix
+{
+
+  matrix U, Vt;
+  vector t;
+  vector * diag;
+  size_t nx, ny, rank;
+
+  lowrank_matrix(int _nx, int _ny, int _rank)
+    : U(_nx, _rank), Vt(_rank, _ny), t(_rank)
+  {
+    nx = _nx; ny = _ny; rank = _rank;
+    diag = NULL;
+  }
+
+  ~lowrank_matrix()
+  {
+    delete diag;
+  }
+
+  // adds a zeroed min(nx, ny) diagonal correction, returned so the caller can fill it
+  vector & addDiagonal()
+  {
+    if(diag == NULL) {
+      diag = new vector(nx < ny ? nx : ny);
+      init(*diag, 0.0f);
+    }
+    return *diag;
+  }
+
+};
+
+void matvecmul(lowrank_matrix & mat, vector & vec, vector & out)
+{
+  if(captureRefused("matvecmul on a lowrank_matrix")) return;
+  if(mat.ny != vec.n || mat.nx != out.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  matvecmul(mat.Vt, vec, mat.t);
+  matvecmul(mat.U, mat.t, out);
+  if(mat.diag == NULL) return;
+
+  vector & d = *mat.diag;
+
+#pragma acc parallel loop \
+ present(d, vec, out)
+  for(int i = 0; i < d.n; i++)
+    out.at(i) += d.at(i)*vec.at(i);
+  out.version++;
+}
+
+// host-side Gaussian samples (Box-Muller over a 64-bit LCG)
+float gaussian(unsigned long long & state)
+{
+  state = state*6364136223846793005ULL + 1442695040888963407ULL;
+  float u1 = ((state >> 40) + 1.0f) / 16777217.0f;
+  state = state*6364136223846793005ULL + 1442695040888963407ULL;
+  float u2 = (state >> 40) / 16777216.0f;
+  return sqrtf(-2.0f*logf(u1)) * cosf(6.2831853f*u2);
+}
+
+float columnNorm(matrix & Q, int c)
+{
+  float norm = 0.0f;
+  for(int i = 0; i < Q.nx; i++) norm += Q.at(i, c)*Q.at(i, c);
+  return sqrtf(norm);
+}
+
+// modified Gram-Schmidt on the columns of Q, on the host. each column is projected twice
+// to keep orthogonality in single precision, and columns that were (numerically) in the
+// span of the previous ones are zeroed, which also zeroes their row of Vt.
+void orthonormalize(matrix & Q)
+{
+  Q.updateCPU();
+  for(int c = 0; c < Q.ny; c++) {
+    float before = columnNorm(Q, c);
+    for(int pass = 0; pass < 2; pass++) {
+      for(int p = 0; p < c; p++) {
+        float d = 0.0f;
+        for(int i = 0; i < Q.nx; i++) d += Q.at(i, p)*Q.at(i, c);
+        for(int i = 0; i < Q.nx; i++) Q.at(i, c) -= d*Q.at(i, p);
+      }
+    }
+    float norm = columnNorm(Q, c);
+    float scale = norm > 1e-4f*before ? 1.0f/norm : 0.0f;
+    for(int i = 0; i < Q.nx; i++) Q.at(i, c) *= scale;
+  }
+  Q.updateGPU();
+}
+
+void rsvd(matrix & A, lowrank_matrix & L, int power = 1, unsigned long long seed = 1)
+{
+  if(captureRefused("rsvd")) return;
+  if(L.nx != A.nx || L.ny != A.ny) {
+    std::cerr << "matrix dimensions incompatible" << std::endl;
+    return;
+  }
+
+  matrix omega(A.ny, L.rank);
+  for(int i = 0; i < omega.nx; i++)
+    for(int j = 0; j < omega.ny; j++)
+      omega.at(i, j) = gaussian(seed);
+  omega.updateGPU();
+
+  gemm(1.0f, A, omega, 0.0f, L.U);
+
+  if(power > 0) {
+    matrix At(A.ny, A.nx);
+    transpose(A, At);
+    for(int p = 0; p < power; p++) {
+      orthonormalize(L.U);
+      gemm(1.0f, At, L.U, 0.0f, omega);
+      orthonormalize(omega);
+      gemm(1.0f, A, omega, 0.0f, L.U);
+    }
+  }
+
+  orthonormalize(L.U);
+
+  matrix Ut(L.rank, A.nx);
+  transpose(L.U, Ut);
+  gemm(1.0f, Ut, A, 0.0f, L.Vt);
+}
+
+
+/**********************************************************************************************
+** Kronecker product operator                                                                **
+***********************************************************************************************
+** (A1 x A2 x ... x Ad)*vec without forming the product. vec is viewed as a d-dimensional    **
+** array with the last index fastest, and each factor is applied along its own mode:         **
+**   y[l, i, r] = sum_j Ak(i, j) * x[l, j, r]                                                **
+** where l runs over the modes before k (already transformed) and r over those after k.      **
+** For d factors of size n this costs d*n^(d+1) instead of n^(2d).                           **
+** The factors are not owned by the operator and must outlive it.                            **
+**********************************************************************************************/
+#define KRON_MAX_FACTORS 8
+
+struct kron_operator
+{
+
+  matrix * factors[KRON_MAX_FACTORS];
+  int nfactors;
+  size_t nx, ny;
+  vector * work[2];
+
+  kron_operator()
+  {
+    nfactors = 0;
+    nx = ny = 1;
+    work[0] = work[1] = NULL;
+  }
+
+  ~kron_operator()
+  {
+    delete work[0];
+    delete work[1];
+  }
+
+  void addFactor(matrix & A)
+  {
+    if(nfactors == KRON_MAX_FACTORS) {
+      std::cerr << "too many Kronecker factors" << std::endl;
+      return;
+    }
+    factors[nfactors++] = &A;
+    nx *= A.nx; ny *= A.ny;
+    delete work[0]; work[0] = NULL;
+    delete work[1]; work[1] = NULL;
+  }
+
+  // largest intermediate between two modes
+  size_t workSize()
+  {
+    size_t largest = 0;
+    for(int k = 1; k < nfactors; k++) {
+      size_t size = 1;
+      for(int f = 0; f < nfactors; f++)
+        size *= f < k ? factors[f]->nx : factors[f]->ny;
+      if(size > largest) largest = size;
+    }
+    return largest;
+  }
+
+};
+
+void kronMode(matrix & A, vector & in, vector & out, int left, int right)
+{
+  int l, i, r, j;
+  float sum;
+
+#pragma acc parallel loop gang collapse(2) \
+ present(A, in, out)
+  for ( l = 0 ; l < left ; l++ ) {
+    for ( i = 0 ; i < A.nx ; i++ ) {
+#pragma acc loop vector private(sum)
+      for ( r = 0 ; r < right ; r++ ) {
+        sum = 0.0f;
+        for ( j = 0 ; j < A.ny ; j++ ) {
+          sum += A.at(i,j)*in.at((l*A.ny + j)*right + r);
+        }
+        out.at((l*A.nx + i)*right + r) = sum;
+      }
+    }
+  }
+
+  out.version++;
+}
+
+void matvecmul(kron_operator & op, vector & vec, vector & out)
+{
+  if(captureRefused("matvecmul on a kron_operator")) return;
+  if(op.nfactors == 0 || op.ny != vec.n || op.nx != out.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  if(op.nfactors > 1 && op.work[0] == NULL) {
+    size_t size = op.workSize();
+    op.work[0] = new vector(size);
+    op.work[1] = new vector(size);
+  }
+
+  vector * in = &vec;
+  size_t left = 1, right = op.ny;
+  for(int k = 0; k < op.nfactors; k++) {
+    matrix & A = *op.factors[k];
+    right /= A.ny;
+    vector * dst = k == op.nfactors - 1 ? &out : op.work[k % 2];
+    kronMode(A, *in, *dst, left, right);
+    left *= A.nx;
+    in = dst;
+  }
+}
+
+
+/**********************************************************************************************
+** Matrix-free stencil operator                                                              **
+***********************************************************************************************
+** A constant-coefficient stencil on an nx x ny x nz grid (ny = nz = 1 for 1D, nz = 1 for    **
+** 2D), applied directly to vec without assembling a matrix. Points outside the grid are     **
+** treated as zero. w[(dz+1)*9 + (dy+1)*3 + (dx+1)] is the weight of neighbour (dx,dy,dz).   **
+** Stencils that only use the centre and the six face neighbours (3, 5 and 7-point) take a   **
+** cheaper kernel than the full 27-point one.                                                **
+** tile clause:                                                                              **
+**   blocks the grid so neighbouring planes and rows are reused from cache                   **
+** Like every other operator here, it plugs in through a matvecmul() overload.               **
+**********************************************************************************************/
+#define STENCIL_TILE_X 32
+#define STENCIL_TILE_Y 4
+#define STENCIL_TILE_Z 2
+
+struct stencil_operator
+{
+
+  float w[27];
+  int gx, gy, gz;
+  size_t nx, ny;
+
+  stencil_operator(int _gx, int _gy = 1, int _gz = 1)
+  {
+    gx = _gx; gy = _gy; gz = _gz;
+    nx = ny = (size_t)_gx*_gy*_gz;
+    for(int k = 0; k < 27; k++) w[k] = 0.0f;
+  }
+
+  float& weight(int dx, int dy, int dz)
+  {
+    return w[(dz+1)*9 + (dy+1)*3 + (dx+1)];
+  }
+
+  // 3, 5 or 7-point negative Laplacian depending on the grid dimension
+  void laplacian()
+  {
+    for(int k = 0; k < 27; k++) w[k] = 0.0f;
+    int dims = 1 + (gy > 1) + (gz > 1);
+    weight(0, 0, 0) = 2.0f*dims;
+    weight(-1, 0, 0) = weight(1, 0, 0) = -1.0f;
+    if(gy > 1) weight(0, -1, 0) = weight(0, 1, 0) = -1.0f;
+    if(gz > 1) weight(0, 0, -1) = weight(0, 0, 1) = -1.0f;
+  }
+
+  bool isStar()
+  {
+    for(int dz = -1; dz <= 1; dz++)
+      for(int dy = -1; dy <= 1; dy++)
+        for(int dx = -1; dx <= 1; dx++)
+          if(abs(dx) + abs(dy) + abs(dz) > 1 && weight(dx, dy, dz) != 0.0f)
+            return false;
+    return true;
+  }
+
+};
+
+void stencilStar(stencil_operator & op, vector & in, vector & out)
+{
+  int gx = op.gx, gy = op.gy, gz = op.gz;
+  float c = op.weight(0, 0, 0);
+  float xm = op.weight(-1, 0, 0), xp = op.weight(1, 0, 0);
+  float ym = op.weight(0, -1, 0), yp = op.weight(0, 1, 0);
+  float zm = op.weight(0, 0, -1), zp = op.weight(0, 0, 1);
+
+#pragma acc parallel loop tile(STENCIL_TILE_X, STENCIL_TILE_Y, STENCIL_TILE_Z) \
+ present(in, out)
+  for(int z = 0; z < gz; z++) {
+    for(int y = 0; y < gy; y++) {
+      for(int x = 0; x < gx; x++) {
+        int i = (z*gy + y)*gx + x;
+        float sum = c*in.at(i);
+        if(x > 0)      sum += xm*in.at(i - 1);
+        if(x < gx - 1) sum += xp*in.at(i + 1);
+        if(y > 0)      sum += ym*in.at(i - gx);
+        if(y < gy - 1) sum += yp*in.at(i + gx);
+        if(z > 0)      sum += zm*in.at(i - gx*gy);
+        if(z < gz - 1) sum += zp*in.at(i + gx*gy);
+        out.at(i) = sum;
+      }
+    }
+  }
+}
+
+void stencilBox(stencil_operator & op, vector & in, vector & out)
+{
+  int gx = op.gx, gy = op.gy, gz = op.gz;
+  float w[27];
+  for(int k = 0; k < 27; k++) w[k] = op.w[k];
+
+#pragma acc parallel loop tile(STENCIL_TILE_X, STENCIL_TILE_Y, STENCIL_TILE_Z) \
+ present(in, out) \
+ copyin(w)
+  for(int z = 0; z < gz; z++) {
+    for(int y = 0; y < gy; y++) {
+      for(int x = 0; x < gx; x++) {
+        float sum = 0.0f;
+#pragma acc loop seq
+        for(int dz = -1; dz <= 1; dz++) {
+          if(z + dz < 0 || z + dz >= gz) continue;
+#pragma acc loop seq
+          for(int dy = -1; dy <= 1; dy++) {
+            if(y + dy < 0 || y + dy >= gy) continue;
+#pragma acc loop seq
+            for(int dx = -1; dx <= 1; dx++) {
+              if(x + dx < 0 || x + dx >= gx) continue;
+              sum += w[(dz+1)*9 + (dy+1)*3 + (dx+1)] *
+                     in.at(((z + dz)*gy + (y + dy))*gx + (x + dx));
+            }
+          }
+        }
+        out.at((z*gy + y)*gx + x) = sum;
+      }
+    }
+  }
+}
+
+void matvecmul(stencil_operator & op, vector & vec, vector & out)
+{
+  if(captureRefused("matvecmul on a stencil_operator")) return;
+  if(op.ny != vec.n || op.nx != out.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  if(op.isStar())
+    stencilStar(op, vec, out);
+  else
+    stencilBox(op, vec, out);
+  out.version++;
+}
+
+
+/**********************************************************************************************
+** Toeplitz and circulant matrices                                                           **
+***********************************************************************************************
+** A Toeplitz matrix is constant along its diagonals, T(i,j) = t[i - j + ny - 1], so it is   **
+** defined by the nx + ny - 1 values in t. A circulant matrix is the square special case     **
+** C(i,j) = c[(i - j) mod n] defined by its first column c.                                  **
+** T*vec is a linear convolution of t with vec, so for large sizes it is computed with       **
+** radix-2 FFTs in O(m log m). The outputs used are entries ny-1 .. nx+ny-2 of the full      **
+** convolution, which a cyclic one of length m >= nx + ny - 1 leaves free of wrap-around.    **
+** A circulant product is itself cyclic: when n is a power of two it is done with n-point    **
+** FFTs of c directly. There is no mixed-radix FFT, so any other n goes through the Toeplitz **
+** path with m the power of two >= 2n - 1, up to 4x the n points a mixed-radix FFT needs.    **
+** The spectrum is cached and only recomputed when t (or c) changes. Small products use a    **
+** direct O(nx*ny) kernel.                                                                   **
+** The FFT is done in place on separate real/imaginary vectors, one parallel loop per        **
+** butterfly stage.                                                                          **
+**********************************************************************************************/
+#define FFT_DIRECT_FACTOR 16.0
+
+void fft(vector & re, vector & im, int logm, float sign)
+{
+  if(captureRefused("fft")) return;
+  int m = 1 << logm;
+
+#pragma acc parallel loop \
+ present(re, im)
+  for(int i = 0; i < m; i++) {
+    int j = 0;
+    for(int b = 0; b < logm; b++)
+      j |= ((i >> b) & 1) << (logm - 1 - b);
+    if(j > i) {
+      float tr = re.at(i), ti = im.at(i);
+      re.at(i) = re.at(j); im.at(i) = im.at(j);
+      re.at(j) = tr; im.at(j) = ti;
+    }
+  }
+
+  for(int half = 1; half < m; half *= 2) {
+#pragma acc parallel loop \
+ present(re, im)
+    for(int k = 0; k < m/2; k++) {
+      int pos = k % half;
+      int a = (k / half)*2*half + pos;
+      int b = a + half;
+      float angle = sign*3.14159265f*pos/half;
+      float wr = cosf(angle), wi = sinf(angle);
+      float br = re.at(b)*wr - im.at(b)*wi;
+      float bi = re.at(b)*wi + im.at(b)*wr;
+      re.at(b) = re.at(a) - br; im.at(b) = im.at(a) - bi;
+      re.at(a) += br;           im.at(a) += bi;
+    }
+  }
+
+  re.version++; im.version++;
+}
+
+struct toeplitz_matrix
+{
+
+  vector t;
+  size_t nx, ny;
+
+  // FFT length and workspaces, allocated on first FFT product
+  int logm;
+  vector * tre, * tim, * xre, * xim;
+  bool haveSpectrum;
+  size_t spectrumVersion;
+
+  toeplitz_matrix(int _nx, int _ny)
+    : t(_nx + _ny - 1)
+  {
+    nx = _nx; ny = _ny;
+    logm = 0;
+    while((1 << logm) < _nx + _ny - 1) logm++;
+    tre = tim = xre = xim = NULL;
+    haveSpectrum = false;
+    spectrumVersion = 0;
+  }
+
+  ~toeplitz_matrix()
+  {
+    delete tre; delete tim;
+    delete xre; delete xim;
+  }
+
+  float& at(int x, int y)
+  {
+    return t.at(x - y + ny - 1);
+  }
+
+  bool useFFT()
+  {
+    double m = 1 << logm;
+    return (double)nx*ny > FFT_DIRECT_FACTOR*m*logm;
+  }
+
+};
+
+struct circulant_matrix : toeplitz_matrix
+{
+
+  vector c;
+  bool haveColumn;
+  size_t columnVersion;
+  bool cyclic;   // n is a power of two: n-point cyclic FFTs of c
+
+  circulant_matrix(int _n)
+    : toeplitz_matrix(_n, _n), c(_n)
+  {
+    haveColumn = false;
+    columnVersion = 0;
+    cyclic = _n > 0 && (_n & (_n - 1)) == 0;
+    if(cyclic) {
+      logm = 0;
+      while((1 << logm) < _n) logm++;
+    }
+  }
+
+  float& at(int x, int y)
+  {
+    return c.at(((x - y) % (int)c.n + c.n) % c.n);
+  }
+
+};
+
+void toeplitzDirect(toeplitz_matrix & mat, vector & vec, vector & out)
+{
+  vector & t = mat.t;
+  int nx = mat.nx, ny = mat.ny;
+  int i, j;
+  float sum;
+
+#pragma acc parallel loop gang \
+ present(t, vec, out) \
+ private(sum)
+  for ( i = 0 ; i < nx ; i++ ) {
+    sum = 0.0f;
+#pragma acc loop vector reduction(+:sum)
+    for ( j = 0 ; j < ny ; j++ ) {
+      sum += t.at(i - j + ny - 1)*vec.at(j);
+    }
+    out.at(i) = sum;
+  }
+}
+
+// out(i) = (kernel (*) vec)(i + offset), a cyclic convolution of length 2^mat.logm; kernel is
+// t with offset ny - 1 for a Toeplitz product, or c with offset 0 for a circulant one
+void toeplitzFFT(toeplitz_matrix & mat, vector & t, int offset, vector & vec, vector & out)
+{
+  int m = 1 << mat.logm;
+
+  if(mat.tre == NULL) {
+    mat.tre = new vector(m); mat.tim = new vector(m);
+    mat.xre = new vector(m); mat.xim = new vector(m);
+  }
+
+  vector & tre = *mat.tre; vector & tim = *mat.tim;
+  vector & xre = *mat.xre; vector & xim = *mat.xim;
+
+  if(!mat.haveSpectrum || mat.spectrumVersion != t.version) {
+#pragma acc parallel loop \
+ present(t, tre, tim)
+    for(int k = 0; k < m; k++) {
+      tre.at(k) = k < t.n ? t.at(k) : 0.0f;
+      tim.at(k) = 0.0f;
+    }
+    fft(tre, tim, mat.logm, -1.0f);
+    mat.haveSpectrum = true;
+    mat.spectrumVersion = t.version;
+  }
+
+#pragma acc parallel loop \
+ present(vec, xre, xim)
+  for(int k = 0; k < m; k++) {
+    xre.at(k) = k < vec.n ? vec.at(k) : 0.0f;
+    xim.at(k) = 0.0f;
+  }
+  fft(xre, xim, mat.logm, -1.0f);
+
+#pragma acc parallel loop \
+ present(tre, tim, xre, xim)
+  for(int k = 0; k < m; k++) {
+    float r = tre.at(k)*xre.at(k) - tim.at(k)*xim.at(k);
+    float i = tre.at(k)*xim.at(k) + tim.at(k)*xre.at(k);
+    xre.at(k) = r; xim.at(k) = i;
+  }
+  fft(xre, xim, mat.logm, 1.0f);
+
+  float scale = 1.0f / m;
+#pragma acc parallel loop \
+ present(xre, out)
+  for(int i = 0; i < out.n; i++)
+    out.at(i) = scale*xre.at(i + offset);
+}
+
+void matvecmul(toeplitz_matrix & mat, vector & vec, vector & out)
+{
+  if(captureRefused("matvecmul on a toeplitz_matrix")) return;
+  if(mat.ny != vec.n || mat.nx != out.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  if(mat.useFFT())
+    toeplitzFFT(mat, mat.t, mat.ny - 1, vec, out);
+  else
+    toeplitzDirect(mat, vec, out);
+  out.version++;
+}
+
+void matvecmul(circulant_matrix & mat, vector & vec, vector & out)
+{
+  if(captureRefused("matvecmul on a circulant_matrix")) return;
+  if(mat.cyclic && mat.useFFT()) {
+    if(mat.ny != vec.n || mat.nx != out.n) {
+      std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+      return;
+    }
+    toeplitzFFT(mat, mat.c, 0, vec, out);
+    out.version++;
+    return;
+  }
+
+  // refresh the diagonals from the first column: t[k] = c[(k - n + 1) mod n]
+  if(!mat.haveColumn || mat.columnVersion != mat.c.version) {
+    vector & c = mat.c;
+    vector & t = mat.t;
+    int n = c.n;
+#pragma acc parallel loop \
+ present(c, t)
+    for(int k = 0; k < t.n; k++)
+      t.at(k) = c.at((k + 1) % n);
+    t.version++;
+    mat.haveColumn = true;
+    mat.columnVersion = c.version;
+  }
+
+  matvecmul((toeplitz_matrix &) mat, vec, out);
+}
+
+
+/**********************************************************************************************
+** Conjugate gradient solver                                                                 **
+***********************************************************************************************
+** Solves A*x = b for a symmetric positive definite A, starting from the x passed in.        **
+** A can be anything with a matvecmul(A, vec, out) overload: matrix, lowrank_matrix,         **
+** kron_operator, stencil_operator, ...                                                      **
+** Returns the number of iterations taken, or -1 if tol was not reached in maxit.            **
+**********************************************************************************************/
+template <class Op>
+int cg(Op & A, vector & b, vector & x, int maxit, float tol)
+{
+  if(captureRefused("cg")) return -1;
+  if(A.nx != b.n || A.ny != x.n || A.nx != A.ny) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return -1;
+  }
+
+  vector r(b.n), p(b.n), Ap(b.n);
+
+  matvecmul(A, x, Ap);
+  copy(b, r);
+  axpy(-1.0f, Ap, r);
+  copy(r, p);
+
+  float rr = dot(r, r);
+  float stop = tol*tol*dot(b, b);
+
+  for(int it = 0; it < maxit; it++) {
+    if(rr <= stop) return it;
+    matvecmul(A, p, Ap);
+    float alpha = rr / dot(p, Ap);
+    axpy(alpha, p, x);
+    axpy(-alpha, Ap, r);
+    float rrNew = dot(r, r);
+    axpby(1.0f, r, rrNew / rr, p);
+    rr = rrNew;
+  }
+
+  return rr <= stop ? maxit : -1;
+}
+
+
+/**********************************************************************************************
+** Communication layer                                                                       **
+***********************************************************************************************
+** The distributed kernels below only talk to other ranks through a communicator, so the     **
+** transport can be swapped. shm_communicator runs every rank as a forked process on one     **
+** machine and moves data through a shared mmap region:                                      **
+**   allgatherBegin() copies this rank's block into the shared buffer and returns at once    **
+**   allgatherEnd() waits at a process-shared barrier, then reads every block back           **
+**   allreduceBegin/End() do the same with one slot per rank; each rank sums its own slice   **
+**   of the slots (reduce-scatter) and, after a second barrier, reads the whole sum (gather) **
+** Two buffers alternate between calls, so a rank that races ahead to the next call never    **
+** overwrites data another rank is still reading.                                            **
+** Fork the ranks before touching the accelerator: a device context does not survive fork.   **
+** Sub-groups (e.g. the ranks of one process row) are separate shm_communicators created     **
+** before spawn() and joined with attach() in each member process.                           **
+**********************************************************************************************/
+// first index of block b when n items are split into nblocks near-equal blocks
+size_t blockStart(size_t n, int nblocks, int b)
+{
+  return n*b / nblocks;
+}
+
+struct communicator
+{
+
+  virtual ~communicator() {}
+  virtual int rank() = 0;
+  virtual int size() = 0;
+  virtual void barrier() = 0;
+  virtual void allgatherBegin(const float * send, int count, int displ) = 0;
+  virtual void allgatherEnd(float * recv, int n) = 0;
+  virtual void allreduceBegin(const float * send, int n) = 0;
+  virtual void allreduceEnd(float * recv, int n) = 0;
+
+};
+
+struct shm_communicator : communicator
+{
+
+  struct shared
+  {
+    pthread_barrier_t barrier;
+  };
+
+  shared * region;
+  float * buffers[2];
+  size_t mapped;
+  int myRank, nranks, maxFloats;
+  int calls;
+  pid_t * children;
+
+  shm_communicator(int _nranks, int _maxFloats)
+  {
+    nranks = _nranks; maxFloats = _maxFloats;
+    myRank = 0; calls = 0;
+    mapped = sizeof(shared) + 2*sizeof(float)*_maxFloats;
+    void * mem = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED) {
+      std::cerr << "shared memory allocation failed" << std::endl;
+      exit(1);
+    }
+    region = (shared *) mem;
+    buffers[0] = (float *)(region + 1);
+    buffers[1] = buffers[0] + _maxFloats;
+
+    pthread_barrierattr_t attr;
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&region->barrier, &attr, _nranks);
+    pthread_barrierattr_destroy(&attr);
+
+    children = new pid_t[_nranks];
+  }
+
+  ~shm_communicator()
+  {
+    if(myRank == 0) pthread_barrier_destroy(&region->barrier);
+    munmap(region, mapped);
+    delete[] children;
+  }
+
+  // forks the other ranks; every process returns with its own rank
+  int spawn()
+  {
+    for(int r = 1; r < nranks; r++) {
+      pid_t pid = fork();
+      if(pid == 0) {
+        myRank = r;
+        return r;
+      }
+      children[r] = pid;
+    }
+    return 0;
+  }
+
+  // other ranks exit here, rank 0 waits for them
+  void join()
+  {
+    if(myRank != 0) exit(0);
+    for(int r = 1; r < nranks; r++)
+      waitpid(children[r], NULL, 0);
+  }
+
+  // joins a sub-group that was created before spawn()
+  void attach(int rank)
+  {
+    myRank = rank;
+  }
+
+  int rank() { return myRank; }
+  int size() { return nranks; }
+
+  void barrier()
+  {
+    pthread_barrier_wait(&region->barrier);
+  }
+
+  void allgatherBegin(const float * send, int count, int displ)
+  {
+    if(displ + count > maxFloats) {
+      std::cerr << "allgather larger than the shared buffer" << std::endl;
+      exit(1);
+    }
+    memcpy(buffers[calls % 2] + displ, send, sizeof(float)*count);
+  }
+
+  void allgatherEnd(float * recv, int n)
+  {
+    if(n > maxFloats) {
+      std::cerr << "allgather larger than the shared buffer" << std::endl;
+      exit(1);
+    }
+    barrier();
+    memcpy(recv, buffers[calls % 2], sizeof(float)*n);
+    calls++;
+  }
+
+  void allreduceBegin(const float * send, int n)
+  {
+    if(n*nranks > maxFloats) {
+      std::cerr << "allreduce larger than the shared buffer" << std::endl;
+      exit(1);
+    }
+    memcpy(buffers[calls % 2] + myRank*n, send, sizeof(float)*n);
+  }
+
+  // reduce-scatter then gather: each rank sums only its 1/nranks slice across the slots and
+  // leaves it in slot 0, so a rank reads about 2n floats however many ranks take part
+  void allreduceEnd(float * recv, int n)
+  {
+    barrier();
+    float * slots = buffers[calls % 2];
+    int lo = (int)blockStart(n, nranks, myRank);
+    int hi = (int)blockStart(n, nranks, myRank + 1);
+    for(int i = lo; i < hi; i++) {
+      float sum = slots[i];
+      for(int r = 1; r < nranks; r++)
+        sum += slots[r*n + i];
+      slots[i] = sum;
+    }
+    barrier();
+    memcpy(recv, slots, sizeof(float)*n);
+    calls++;
+  }
+
+};
+
+
+/**********************************************************************************************
+** Row-partitioned distributed Matrix-Vector multiply                                        **
+***********************************************************************************************
+** Rank r owns rows [rowStart(r), rowStart(r+1)) of the global nx x ny matrix, and the       **
+** matching block [colStart(r), colStart(r+1)) of the input vector. A product:               **
+**   1. publishes the local vec block (allgatherBegin)                                       **
+**   2. multiplies the diagonal block, which only needs local data                           **
+**   3. completes the allgather and uploads the remote parts of vec                          **
+**   4. adds in the off-diagonal columns                                                     **
+** so the wait for slower ranks overlaps with step 2.                                        **
+**********************************************************************************************/
+// out = [out +] mat(:, c0:c1)*vec(c0:c1)
+void matvecmulColumns(matrix & mat, vector & vec, vector & out, int c0, int c1, bool accumulate)
+{
+  int i, j;
+  float sum;
+
+#pragma acc parallel loop gang \
+ present(mat, vec, out) \
+ private(sum)
+  for ( i = 0 ; i < mat.nx ; i++ ) {
+    sum = accumulate ? out.at(i) : 0.0f;
+#pragma acc loop vector reduction(+:sum)
+    for ( j = c0 ; j < c1 ; j++ ) {
+      sum += mat.at(i,j)*vec.at(j);
+    }
+    out.at(i) = sum;
+  }
+}
+
+struct dist_matrix
+{
+
+  matrix local;
+  vector xfull;
+  size_t nx, ny;
+  size_t row0, col0, col1;
+
+  dist_matrix(communicator & comm, int _nx, int _ny)
+    : local(blockStart(_nx, comm.size(), comm.rank() + 1) - blockStart(_nx, comm.size(), comm.rank()), _ny),
+      xfull(_ny)
+  {
+    nx = _nx; ny = _ny;
+    row0 = blockStart(_nx, comm.size(), comm.rank());
+    col0 = blockStart(_ny, comm.size(), comm.rank());
+    col1 = blockStart(_ny, comm.size(), comm.rank() + 1);
+  }
+
+  // global row x, column y; only valid for rows this rank owns
+  float& at(int x, int y)
+  {
+    return local.at(x - row0, y);
+  }
+
+};
+
+void matvecmul(dist_matrix & mat, vector & vec, vector & out, communicator & comm)
+{
+  if(captureRefused("matvecmul on a dist_matrix")) return;
+  if(vec.n != mat.col1 - mat.col0 || out.n != mat.local.nx) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  vector & x = mat.xfull;
+  int c0 = mat.col0, c1 = mat.col1;
+
+  vec.updateCPU();
+  comm.allgatherBegin(vec.data, vec.n, c0);
+
+#pragma acc parallel loop \
+ present(vec, x)
+  for(int j = c0; j < c1; j++)
+    x.at(j) = vec.at(j - c0);
+  matvecmulColumns(mat.local, x, out, c0, c1, false);
+
+  // the gather also returns our own block, which the device already has
+  float * host = x.data;
+  comm.allgatherEnd(host, x.n);
+  int ny = x.n;
+  if(c0 > 0) {
+    #pragma acc update device(host[0:c0])
+  }
+  if(c1 < ny) {
+    #pragma acc update device(host[c1:ny-c1])
+  }
+  x.version++;
+
+  if(c0 > 0)  matvecmulColumns(mat.local, x, out, 0, c0, true);
+  if(c1 < ny) matvecmulColumns(mat.local, x, out, c1, ny, true);
+  out.version++;
+}
+
+
+/**********************************************************************************************
+** 2D block-cyclic distributed Matrix-Vector multiply                                        **
+***********************************************************************************************
+** Ranks form a pr x pc grid, rank = p*pc + q. Rows are dealt out in blocks of nb to the pr  **
+** process rows in turn, columns likewise to the pc process columns, and rank (p,q) stores   **
+** the intersection as one compact local matrix.                                             **
+** vec is distributed by process column: every rank in column q holds the entries of the     **
+** columns q owns. A product is a local matvecmul on that segment followed by a sum of the   **
+** partial results across the process row, after which every rank in row p holds the out     **
+** entries of the rows p owns. Each rank sends and receives O(n/sqrt(p)) values instead of   **
+** the O(n) of the row-partitioned version.                                                  **
+**********************************************************************************************/
+size_t cyclicCount(size_t n, int nb, int nprocs, int p)
+{
+  size_t nblocks = (n + nb - 1) / nb;
+  size_t count = 0;
+  for(size_t b = p; b < nblocks; b += nprocs)
+    count += b*nb + nb <= n ? nb : n - b*nb;
+  return count;
+}
+
+int cyclicOwner(size_t i, int nb, int nprocs)
+{
+  return (i / nb) % nprocs;
+}
+
+size_t cyclicLocal(size_t i, int nb, int nprocs)
+{
+  return (i / nb / nprocs)*nb + i % nb;
+}
+
+size_t cyclicGlobal(size_t l, int nb, int nprocs, int p)
+{
+  return ((l / nb)*nprocs + p)*nb + l % nb;
+}
+
+struct grid_matrix
+{
+
+  matrix local;
+  vector partial;
+  size_t nx, ny;
+  int pr, pc, p, q, nb;
+
+  grid_matrix(int _nx, int _ny, int _pr, int _pc, int rank, int _nb)
+    : local(cyclicCount(_nx, _nb, _pr, rank / _pc), cyclicCount(_ny, _nb, _pc, rank % _pc)),
+      partial(cyclicCount(_nx, _nb, _pr, rank / _pc))
+  {
+    nx = _nx; ny = _ny;
+    pr = _pr; pc = _pc; nb = _nb;
+    p = rank / _pc; q = rank % _pc;
+  }
+
+  bool owns(int x, int y)
+  {
+    return cyclicOwner(x, nb, pr) == p && cyclicOwner(y, nb, pc) == q;
+  }
+
+  // global row x, column y; only valid for entries this rank owns
+  float& at(int x, int y)
+  {
+    return local.at(cyclicLocal(x, nb, pr), cyclicLocal(y, nb, pc));
+  }
+
+};
+
+// rowComm connects the pc ranks of this rank's process row
+void matvecmul(grid_matrix & mat, vector & vec, vector & out, communicator & rowComm)
+{
+  if(captureRefused("matvecmul on a grid_matrix")) return;
+  if(vec.n != mat.local.ny || out.n != mat.local.nx || rowComm.size() != mat.pc) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  matvecmul(mat.local, vec, mat.partial);
+  mat.partial.updateCPU();
+  rowComm.allreduceBegin(mat.partial.data, mat.partial.n);
+  rowComm.allreduceEnd(out.data, out.n);
+  out.updateGPU();
+}
+
+
+/**********************************************************************************************
+** Batched Matrix-Vector multiply                                                            **
+***********************************************************************************************
+** Y(b,:) = mat*X(b,:) for the first nvec rows of X. Each gang reads its row of mat once     **
+** and reuses it, from cache, for every vector in the batch, so k products cost about one    **
+** pass over mat instead of k.                                                               **
+** loop seq:                                                                                 **
+**   runs the loop sequentially inside each parallel unit                                    **
+**********************************************************************************************/
+void matvecmul_batch(matrix & mat, matrix & X, matrix & Y, int nvec)
+{
+  if(captureRefused("matvecmul_batch")) return;
+  if(X.ny != mat.ny || Y.ny != mat.nx || nvec > X.nx || nvec > Y.nx) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  int i, b, j;
+  float sum;
+
+#pragma acc parallel loop gang \
+ present(mat, X, Y)
+  for ( i = 0 ; i < mat.nx ; i++ ) {
+#pragma acc loop seq
+    for ( b = 0 ; b < nvec ; b++ ) {
+      sum = 0.0f;
+#pragma acc loop vector reduction(+:sum)
+      for ( j = 0 ; j < mat.ny ; j++ ) {
+        sum += mat.at(i,j)*X.at(b,j);
+      }
+      Y.at(b,i) = sum;
+    }
+  }
+
+  Y.version++;
+}
+
+
+/**********************************************************************************************
+** Matrix-Vector multiply service                                                            **
+***********************************************************************************************
+** Keeps one matrix resident on the device and serves products to many callers. submit()     **
+** queues a request and blocks until it is done. A worker thread waits until either          **
+** maxBatch requests are queued or the oldest one has waited window seconds, then runs the   **
+** whole group as one matvecmul_batch, so throughput grows with load while the added         **
+** latency stays below the window.                                                           **
+** serveUnixSocket() exposes the same service on a Unix-domain socket: a client writes ny    **
+** floats and reads back nx floats, as many times as it likes on one connection. It runs     **
+** until stop() is called on its matvec_socket, then closes every connection and joins their **
+** threads before returning, so the service may be destroyed once it has returned.           **
+**********************************************************************************************/
+double nowSeconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+struct matvec_request
+{
+  const float * x;
+  float * y;
+  double arrival;
+  bool done;
+  matvec_request * next;
+};
+
+struct matvec_service
+{
+
+  matrix & mat;
+  matrix X, Y;
+  int maxBatch;
+  double window;
+
+  pthread_mutex_t lock;
+  pthread_cond_t arrived, finished;
+  pthread_t worker;
+  matvec_request * head, * tail;
+  int queued;
+  bool stopping;
+
+  size_t batches, requests;
+
+  matvec_service(matrix & _mat, int _maxBatch, double _window)
+    : mat(_mat), X(_maxBatch, _mat.ny), Y(_maxBatch, _mat.nx)
+  {
+    maxBatch = _maxBatch; window = _window;
+    head = tail = NULL;
+    queued = 0;
+    stopping = false;
+    batches = requests = 0;
+    pthread_mutex_init(&lock, NULL);
+    // the batching window is timed on the monotonic clock, like nowSeconds()
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&arrived, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&finished, NULL);
+    pthread_create(&worker, NULL, run, this);
+  }
+
+  ~matvec_service()
+  {
+    stop();
+    pthread_cond_destroy(&finished);
+    pthread_cond_destroy(&arrived);
+    pthread_mutex_destroy(&lock);
+  }
+
+  void stop()
+  {
+    pthread_mutex_lock(&lock);
+    bool running = !stopping;
+    stopping = true;
+    pthread_cond_broadcast(&arrived);
+    pthread_mutex_unlock(&lock);
+    if(running) pthread_join(worker, NULL);
+  }
+
+  // y = mat*x, x has mat.ny entries and y mat.nx, both on the host.
+  // returns false, leaving y untouched, once the service is stopping
+  bool submit(const float * x, float * y)
+  {
+    matvec_request req;
+    req.x = x; req.y = y;
+    req.done = false;
+    req.next = NULL;
+
+    pthread_mutex_lock(&lock);
+    if(stopping) {
+      pthread_mutex_unlock(&lock);
+      std::cerr << "matvec_service: request after stop()" << std::endl;
+      return false;
+    }
+    req.arrival = nowSeconds();
+    if(tail) tail->next = &req; else head = &req;
+    tail = &req;
+    queued++;
+    pthread_cond_signal(&arrived);
+    while(!req.done)
+      pthread_cond_wait(&finished, &lock);
+    pthread_mutex_unlock(&lock);
+    return true;
+  }
+
+  static void * run(void * arg)
+  {
+    ((matvec_service *) arg)->loop();
+    return NULL;
+  }
+
+  void loop()
+  {
+    matvec_request ** batch = new matvec_request*[maxBatch];
+
+    pthread_mutex_lock(&lock);
+    while(true) {
+      while(head == NULL && !stopping)
+        pthread_cond_wait(&arrived, &lock);
+      if(head == NULL) break;
+
+      double deadline = head->arrival + window;
+      struct timespec ts;
+      ts.tv_sec = (time_t) deadline;
+      ts.tv_nsec = (long)((deadline - ts.tv_sec)*1e9);
+      while(queued < maxBatch && !stopping && nowSeconds() < deadline)
+        pthread_cond_timedwait(&arrived, &lock, &ts);
+
+      int k = 0;
+      while(head != NULL && k < maxBatch) {
+        batch[k++] = head;
+        head = head->next;
+      }
+      if(head == NULL) tail = NULL;
+      queued -= k;
+      pthread_mutex_unlock(&lock);
+
+      compute(batch, k);
+
+      pthread_mutex_lock(&lock);
+      for(int b = 0; b < k; b++)
+        batch[b]->done = true;
+      batches++; requests += k;
+      pthread_cond_broadcast(&finished);
+    }
+    pthread_mutex_unlock(&lock);
+
+    delete[] batch;
+  }
+
+  void compute(matvec_request ** batch, int k)
+  {
+    size_t nx = mat.nx, ny = mat.ny;
+    for(int b = 0; b < k; b++)
+      memcpy(&X.at(b, 0), batch[b]->x, sizeof(float)*ny);
+
+    float * xdata = X.data;
+    float * ydata = Y.data;
+    #pragma acc update device(xdata[0:k*ny])
+    X.version++;
+
+    matvecmul_batch(mat, X, Y, k);
+
+    #pragma acc update self(ydata[0:k*nx])
+    for(int b = 0; b < k; b++)
+      memcpy(batch[b]->y, &Y.at(b, 0), sizeof(float)*nx);
+  }
+
+};
+
+bool readFull(int fd, void * buf, size_t bytes)
+{
+  char * p = (char *) buf;
+  while(bytes > 0) {
+    ssize_t got = read(fd, p, bytes);
+    if(got <= 0) return false;
+    p += got; bytes -= got;
+  }
+  return true;
+}
+
+bool writeFull(int fd, const void * buf, size_t bytes)
+{
+  const char * p = (const char *) buf;
+  while(bytes > 0) {
+    ssize_t put = write(fd, p, bytes);
+    if(put <= 0) return false;
+    p += put; bytes -= put;
+  }
+  return true;
+}
+
+struct matvec_socket;
+
+struct matvec_connection
+{
+  matvec_socket * server;
+  int fd;              // -1 once the connection thread has closed it
+  bool finished;
+  pthread_t thread;
+  matvec_connection * next;
+};
+
+// listening socket and connection threads of one serveUnixSocket() call
+struct matvec_socket
+{
+
+  matvec_service * service;
+  int fd;
+  bool stopping;
+  matvec_connection * connections;   // threads not yet joined
+  pthread_mutex_t lock;
+
+  matvec_socket(matvec_service & _service)
+  {
+    service = &_service;
+    fd = -1;
+    stopping = false;
+    connections = NULL;
+    pthread_mutex_init(&lock, NULL);
+  }
+
+  ~matvec_socket()
+  {
+    pthread_mutex_destroy(&lock);
+  }
+
+  // wakes the accept loop and every connection; safe to call from any thread, and before
+  // serveUnixSocket() has started listening
+  void stop()
+  {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    if(fd >= 0) shutdown(fd, SHUT_RDWR);
+    for(matvec_connection * c = connections; c != NULL; c = c->next)
+      if(c->fd >= 0) shutdown(c->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&lock);
+  }
+
+  // joins the connection threads that have finished, or all of them
+  void reap(bool all)
+  {
+    matvec_connection * done = NULL;
+    pthread_mutex_lock(&lock);
+    matvec_connection ** link = &connections;
+    while(*link != NULL) {
+      matvec_connection * c = *link;
+      if(all || c->finished) {
+        *link = c->next;
+        c->next = done;
+        done = c;
+      } else {
+        link = &c->next;
+      }
+    }
+    pthread_mutex_unlock(&lock);
+
+    while(done != NULL) {
+      matvec_connection * c = done;
+      done = c->next;
+      pthread_join(c->thread, NULL);
+      delete c;
+    }
+  }
+
+};
+
+void * serveConnection(void * arg)
+{
+  matvec_connection * conn = (matvec_connection *) arg;
+  matvec_socket & server = *conn->server;
+  matvec_service & service = *server.service;
+  float * x = new float[service.mat.ny];
+  float * y = new float[service.mat.nx];
+
+  while(readFull(conn->fd, x, sizeof(float)*service.mat.ny)) {
+    if(!service.submit(x, y)) break;
+    if(!writeFull(conn->fd, y, sizeof(float)*service.mat.nx)) break;
+  }
+
+  pthread_mutex_lock(&server.lock);
+  close(conn->fd);
+  conn->fd = -1;
+  conn->finished = true;
+  pthread_mutex_unlock(&server.lock);
+  delete[] x; delete[] y;
+  return NULL;
+}
+
+// accepts clients on path until server.stop() (or a failing accept); one thread per connection
+int serveUnixSocket(matvec_socket & server, const char * path)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0) {
+    std::cerr << "cannot create socket" << std::endl;
+    return -1;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+  if(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+    std::cerr << "cannot listen on " << path << std::endl;
+    close(fd);
+    return -1;
+  }
+
+  pthread_mutex_lock(&server.lock);
+  server.fd = fd;
+  bool stopping = server.stopping;
+  pthread_mutex_unlock(&server.lock);
+
+  while(!stopping) {
+    int client = accept(fd, NULL, NULL);
+    pthread_mutex_lock(&server.lock);
+    stopping = server.stopping || client < 0;
+    if(!stopping) {
+      matvec_connection * conn = new matvec_connection;
+      conn->server = &server;
+      conn->fd = client;
+      conn->finished = false;
+      conn->next = server.connections;
+      server.connections = conn;
+      pthread_create(&conn->thread, NULL, serveConnection, conn);
+    } else if(client >= 0) {
+      close(client);
+    }
+    pthread_mutex_unlock(&server.lock);
+    server.reap(false);
+  }
+
+  // also reached when accept fails: the remaining connections are closed either way
+  server.stop();
+  pthread_mutex_lock(&server.lock);
+  server.fd = -1;
+  pthread_mutex_unlock(&server.lock);
+  close(fd);
+  unlink(path);
+  server.reap(true);
+  return 0;
+}
+
+
+/**********************************************************************************************
+** Shared-memory request ring                                                                **
+***********************************************************************************************
+** Lets other processes on the machine use a resident matrix without copying vectors         **
+** through a socket. A named POSIX shared memory object holds nslots request slots, each     **
+** with room for an input of ny floats and a result of nx floats. A slot moves through       **
+**   FREE -> CLAIMED (client CAS) -> READY (client) -> DONE (server) -> FREE (client)        **
+** with atomic stores only. Sleeping is done with futexes in the shared mapping: the server  **
+** waits on the posted counter, a client on its slot state.                                  **
+** The client writes its input straight into the slot returned by acquire(), and the         **
+** server wraps every slot in vector views, so the only copies are the device updates.       **
+**********************************************************************************************/
+#define SHM_RING_MAX_SLOTS 64
+
+enum { SLOT_FREE, SLOT_CLAIMED, SLOT_READY, SLOT_DONE };
+
+int futexWait(int * addr, int expected, long timeoutNs)
+{
+  struct timespec ts;
+  ts.tv_sec = timeoutNs / 1000000000L;
+  ts.tv_nsec = timeoutNs % 1000000000L;
+  return syscall(SYS_futex, addr, FUTEX_WAIT, expected, timeoutNs > 0 ? &ts : NULL, NULL, 0);
+}
+
+int futexWake(int * addr)
+{
+  return syscall(SYS_futex, addr, FUTEX_WAKE, 0x7fffffff, NULL, NULL, 0);
+}
+
+struct shm_ring
+{
+
+  struct header
+  {
+    int nslots, nx, ny;
+    int posted;
+    int state[SHM_RING_MAX_SLOTS];
+  };
+
+  header * hdr;
+  float * xs, * ys;
+  size_t bytes;
+  bool creator;
+  char name[64];
+
+  // server side: creates the ring
+  shm_ring(const char * _name, int nslots, int nx, int ny)
+  {
+    if(nslots > SHM_RING_MAX_SLOTS) nslots = SHM_RING_MAX_SLOTS;
+    creator = true;
+    bytes = sizeof(header) + sizeof(float)*nslots*(nx + ny);
+    map(_name, O_CREAT | O_RDWR);
+    hdr->nslots = nslots; hdr->nx = nx; hdr->ny = ny;
+    hdr->posted = 0;
+    for(int k = 0; k < nslots; k++) hdr->state[k] = SLOT_FREE;
+    layout();
+  }
+
+  // client side: attaches to an existing ring
+  shm_ring(const char * _name)
+  {
+    creator = false;
+    bytes = sizeof(header);
+    map(_name, O_RDWR);
+    size_t full = sizeof(header) + sizeof(float)*hdr->nslots*(hdr->nx + hdr->ny);
+    munmap(hdr, bytes);
+    bytes = full;
+    map(_name, O_RDWR);
+    layout();
+  }
+
+  ~shm_ring()
+  {
+    munmap(hdr, bytes);
+    if(creator) shm_unlink(name);
+  }
+
+  void map(const char * _name, int flags)
+  {
+    strncpy(name, _name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = 0;
+    int fd = shm_open(name, flags, 0600);
+    if(fd < 0 || (creator && ftruncate(fd, bytes) < 0)) {
+      std::cerr << "cannot open shared memory " << name << std::endl;
+      exit(1);
+    }
+    hdr = (header *) mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(hdr == MAP_FAILED) {
+      std::cerr << "cannot map shared memory " << name << std::endl;
+      exit(1);
+    }
+  }
+
+  void layout()
+  {
+    xs = (float *)(hdr + 1);
+    ys = xs + hdr->nslots*hdr->ny;
+  }
+
+  float * input(int slot) { return xs + slot*hdr->ny; }
+  float * result(int slot) { return ys + slot*hdr->nx; }
+
+  // client: claims a free slot and returns where to write the ny inputs
+  float * acquire(int & slot)
+  {
+    while(true) {
+      for(int k = 0; k < hdr->nslots; k++) {
+        int expected = SLOT_FREE;
+        if(__atomic_compare_exchange_n(&hdr->state[k], &expected, SLOT_CLAIMED, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+          slot = k;
+          return input(k);
+        }
+      }
+      sched_yield();
+    }
+  }
+
+  // client: hands the slot to the server and sleeps until the nx results are ready
+  const float * call(int slot)
+  {
+    __atomic_store_n(&hdr->state[slot], SLOT_READY, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&hdr->posted, 1, __ATOMIC_RELEASE);
+    futexWake(&hdr->posted);
+    while(__atomic_load_n(&hdr->state[slot], __ATOMIC_ACQUIRE) != SLOT_DONE)
+      futexWait(&hdr->state[slot], SLOT_READY, 0);
+    return result(slot);
+  }
+
+  void release(int slot)
+  {
+    __atomic_store_n(&hdr->state[slot], SLOT_FREE, __ATOMIC_RELEASE);
+  }
+
+};
+
+// serves requests on ring with mat until *stop is set
+void serveRing(shm_ring & ring, matrix & mat, volatile bool * stop)
+{
+  int nslots = ring.hdr->nslots;
+  if(ring.hdr->nx != mat.nx || ring.hdr->ny != mat.ny) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  vector ** xv = new vector*[nslots];
+  vector ** yv = new vector*[nslots];
+  for(int k = 0; k < nslots; k++) {
+    xv[k] = new vector(ring.input(k), mat.ny);
+    yv[k] = new vector(ring.result(k), mat.nx);
+  }
+
+  while(!*stop) {
+    int seen = __atomic_load_n(&ring.hdr->posted, __ATOMIC_ACQUIRE);
+    bool found = false;
+    for(int k = 0; k < nslots; k++) {
+      if(__atomic_load_n(&ring.hdr->state[k], __ATOMIC_ACQUIRE) != SLOT_READY) continue;
+      found = true;
+      xv[k]->updateGPU();
+      matvecmul(mat, *xv[k], *yv[k]);
+      yv[k]->updateCPU();
+      __atomic_store_n(&ring.hdr->state[k], SLOT_DONE, __ATOMIC_RELEASE);
+      futexWake(&ring.hdr->state[k]);
+    }
+    // the timeout only bounds how long a stop request can go unnoticed
+    if(!found) futexWait(&ring.hdr->posted, seen, 100000000L);
+  }
+
+  for(int k = 0; k < nslots; k++) {
+    delete xv[k];
+    delete yv[k];
+  }
+  delete[] xv;
+  delete[] yv;
+}
+
+
+/**********************************************************************************************
+** Multi-tenant Matrix-Vector scheduler                                                      **
+***********************************************************************************************
+** Several workloads calling matvecmul at once each start a full-width parallel region and   **
+** fight over the same cores. matvec_scheduler owns a pool of ncores cores instead: run()    **
+** blocks until cores are free, gives the job a share proportional to its weight among the   **
+** jobs running or waiting, and runs it with an OpenMP team of that size pinned to exactly   **
+** those cores. Waiting jobs are admitted highest weight first, FIFO among equals.           **
+** Slots map onto the CPUs in the process's affinity mask, and every thread gets its old     **
+** affinity back when the job ends, so the caller is not left bound to one core.             **
+** num_threads clause (OpenMP):                                                              **
+**   sets the size of the thread team for one parallel region                                **
+** Jobs compute on the host copies of their data, so run() first pushes any dirty rows of    **
+** mat, then downloads mat and vec, and pushes out back to the device afterwards; callers    **
+** keep the device-resident pattern of every other kernel.                                   **
+**********************************************************************************************/
+// cores are CPU ids; each thread's previous affinity is restored before returning.
+// returns false if some thread could not be pinned (the product is still computed)
+bool matvecmul_cores(matrix & mat, vector & vec, vector & out, const int * cores, int ncores)
+{
+  int failed = 0;
+
+#pragma omp parallel num_threads(ncores) reduction(+:failed)
+  {
+    int t = omp_get_thread_num();
+    cpu_set_t saved, set;
+    bool restore = pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved) == 0;
+    CPU_ZERO(&set);
+    CPU_SET(cores[t], &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) failed++;
+
+#pragma omp for schedule(static)
+    for(int i = 0; i < (int)mat.nx; i++) {
+      float sum = 0.0f;
+#pragma omp simd reduction(+:sum)
+      for(int j = 0; j < (int)mat.ny; j++)
+        sum += mat.at(i,j)*vec.at(j);
+      out.at(i) = sum;
+    }
+
+    if(!restore || pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved) != 0) failed++;
+  }
+
+  if(failed > 0)
+    std::cerr << "matvecmul_cores: could not set thread affinity" << std::endl;
+  return failed == 0;
+}
+
+struct matvec_job
+{
+  double weight;
+  double submitted;
+  matvec_job * next;
+};
+
+struct matvec_scheduler
+{
+
+  int ncores, nfree;
+  int * cpus;    // CPU id behind each scheduler slot
+  bool * busy;
+  double runningWeight;
+  matvec_job * waiting;
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+
+  size_t jobs;
+  double totalDelay, maxDelay;
+
+  // slots map onto the CPUs this process may run on, so ncores is at most their count
+  matvec_scheduler(int _ncores)
+  {
+    cpu_set_t allowed;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+      std::cerr << "matvec_scheduler: sched_getaffinity failed" << std::endl;
+      CPU_ZERO(&allowed);
+      CPU_SET(sched_getcpu() >= 0 ? sched_getcpu() : 0, &allowed);
+    }
+    ncores = 0;
+    cpus = new int[_ncores > 0 ? _ncores : 1];
+    for(int c = 0; c < CPU_SETSIZE && ncores < _ncores; c++)
+      if(CPU_ISSET(c, &allowed)) cpus[ncores++] = c;
+    nfree = ncores;
+    busy = new bool[ncores > 0 ? ncores : 1]();
+    runningWeight = 0.0;
+    waiting = NULL;
+    jobs = 0;
+    totalDelay = maxDelay = 0.0;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&changed, NULL);
+  }
+
+  ~matvec_scheduler()
+  {
+    pthread_cond_destroy(&changed);
+    pthread_mutex_destroy(&lock);
+    delete[] cpus;
+    delete[] busy;
+  }
+
+  double meanDelay()
+  {
+    return jobs > 0 ? totalDelay / jobs : 0.0;
+  }
+
+  void run(matrix & mat, vector & vec, vector & out, double weight = 1.0)
+  {
+    if(captureRefused("matvec_scheduler::run")) return;
+    if(mat.ny != vec.n || mat.nx != out.n) {
+      std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+      return;
+    }
+
+    mat.updateGPURows();
+    mat.updateCPU();
+    vec.updateCPU();
+
+    matvec_job job;
+    job.weight = weight;
+    int * cores = new int[ncores];
+    int * ids = new int[ncores];
+    int share = admit(job, cores);
+
+    for(int k = 0; k < share; k++) ids[k] = cpus[cores[k]];
+    matvecmul_cores(mat, vec, out, ids, share);
+    out.version++;
+    out.updateGPU();
+
+    pthread_mutex_lock(&lock);
+    for(int k = 0; k < share; k++) busy[cores[k]] = false;
+    nfree += share;
+    runningWeight -= weight;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    delete[] cores;
+    delete[] ids;
+  }
+
+  // queues job, waits for its turn and picks its cores; returns how many it got
+  int admit(matvec_job & job, int * cores)
+  {
+    pthread_mutex_lock(&lock);
+    job.submitted = nowSeconds();
+
+    matvec_job ** link = &waiting;
+    while(*link != NULL && (*link)->weight >= job.weight) link = &(*link)->next;
+    job.next = *link;
+    *link = &job;
+
+    while(waiting != &job || nfree == 0)
+      pthread_cond_wait(&changed, &lock);
+    waiting = job.next;
+
+    double totalWeight = runningWeight + job.weight;
+    for(matvec_job * w = waiting; w != NULL; w = w->next) totalWeight += w->weight;
+    int share = (int)(ncores*job.weight/totalWeight);
+    if(share < 1) share = 1;
+    if(share > nfree) share = nfree;
+
+    int got = 0;
+    for(int c = 0; c < ncores && got < share; c++)
+      if(!busy[c]) { busy[c] = true; cores[got++] = c; }
+    nfree -= share;
+    runningWeight += job.weight;
+
+    double delay = nowSeconds() - job.submitted;
+    jobs++;
+    totalDelay += delay;
+    if(delay > maxDelay) maxDelay = delay;
+
+    // the next waiting job may also fit
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    return share;
+  }
+
+};
+
+
+/**********************************************************************************************
+** Asynchronous operations and coroutines                                                    **
+***********************************************************************************************
+** async clause:                                                                             **
+**   queues the compute region or update on an async queue and returns to the host at once.  **
+**   work on the same queue runs in order, different queues may overlap                      **
+** acc_async_test:                                                                           **
+**   non-blocking check whether everything queued on a queue has finished                    **
+** init() and matvecmul() take the queue as an optional last argument, like axpy() does.     **
+** With C++20 coroutines each operation also has an awaitable form, e.g.                     **
+**   co_await updateGPU_co(loop, vec, q); co_await matvecmul_co(loop, mat, vec, out, q);     **
+** Awaiting parks the coroutine in an acc_loop instead of blocking; acc_loop::run() resumes  **
+** each one when its queue drains, so one thread can drive many independent pipelines.       **
+** Build with -std=c++20 to enable the coroutine part.                                       **
+**********************************************************************************************/
+#ifdef HAVE_COROUTINES
+struct acc_loop
+{
+
+  struct parked
+  {
+    int queue;
+    std::coroutine_handle<> handle;
+    parked * next;
+  };
+
+  parked * head;
+
+  acc_loop()
+  {
+    head = NULL;
+  }
+
+  void park(int queue, std::coroutine_handle<> handle)
+  {
+    parked * p = new parked;
+    p->queue = queue; p->handle = handle;
+    p->next = head;
+    head = p;
+  }
+
+  // resumes parked coroutines as their queues drain, until none are left
+  void run()
+  {
+    while(head != NULL) {
+      bool resumed = false;
+      for(parked ** link = &head; *link != NULL; link = &(*link)->next) {
+        if(!acc_async_test((*link)->queue)) continue;
+        parked * p = *link;
+        *link = p->next;
+        std::coroutine_handle<> handle = p->handle;
+        delete p;
+        // may park new entries at head, so start the scan over
+        handle.resume();
+        resumed = true;
+        break;
+      }
+      if(!resumed) sched_yield();
+    }
+  }
+
+};
+
+// returned by the *_co functions: the work is already queued, awaiting waits for the queue
+struct acc_awaitable
+{
+  acc_loop * loop;
+  int queue;
+
+  bool await_ready() { return acc_async_test(queue) != 0; }
+  void await_suspend(std::coroutine_handle<> handle) { loop->park(queue, handle); }
+  void await_resume() {}
+};
+
+// coroutine type for pipelines: starts eagerly and cleans itself up when it finishes
+struct acc_task
+{
+  struct promise_type
+  {
+    acc_task get_return_object() { return acc_task(); }
+    std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+    std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+acc_awaitable init_co(acc_loop & loop, matrix & mat, float val, int queue)
+{
+  init(mat, val, queue);
+  return acc_awaitable{&loop, queue};
+}
+
+acc_awaitable init_co(acc_loop & loop, vector & vec, float val, int queue)
+{
+  init(vec, val, queue);
+  return acc_awaitable{&loop, queue};
+}
+
+acc_awaitable matvecmul_co(acc_loop & loop, matrix & mat, vector & vec, vector & out, int queue)
+{
+  matvecmul(mat, vec, out, queue);
+  return acc_awaitable{&loop, queue};
+}
+
+acc_awaitable updateCPU_co(acc_loop & loop, matrix & mat, int queue)
+{
+  mat.updateCPU(queue);
+  return acc_awaitable{&loop, queue};
+}
+
+acc_awaitable updateCPU_co(acc_loop & loop, vector & vec, int queue)
+{
+  vec.updateCPU(queue);
+  return acc_awaitable{&loop, queue};
+}
+
+acc_awaitable updateGPU_co(acc_loop & loop, matrix & mat, int queue)
+{
+  mat.updateGPU(queue);
+  return acc_awaitable{&loop, queue};
+}
+
+acc_awaitable updateGPU_co(acc_loop & loop, vector & vec, int queue)
+{
+  vec.updateGPU(queue);
+  return acc_awaitable{&loop, queue};
+}
+
+// one pipeline: upload vec, multiply, download out, all on queue
+acc_task matvecmul_pipeline(acc_loop & loop, matrix & mat, vector & vec, vector & out, int queue)
+{
+  co_await updateGPU_co(loop, vec, queue);
+  co_await matvecmul_co(loop, mat, vec, out, queue);
+  co_await updateCPU_co(loop, out, queue);
+}
+#endif
+
+
+/**********************************************************************************************
+** Task graphs                                                                               **
+***********************************************************************************************
+** A task_graph records operations on matrices and vectors together with what each one       **
+** reads and writes, without running them. finalize() walks the record once in program       **
+** order and spreads the tasks over GRAPH_QUEUES async queues: a task goes on the queue of   **
+** one of the tasks it depends on, or on a fresh queue if it has none, and waits for the     **
+** other queues it depends on. run() then only launches kernels and waits, so a graph can    **
+** be recorded once and replayed every iteration, with independent chains overlapping.       **
+** acc_wait_async(p, q):                                                                     **
+**   makes queue q wait for everything queued on p so far, without blocking the host         **
+** dot tasks leave their result in a one-element vector so they can stay asynchronous.       **
+**********************************************************************************************/
+#define GRAPH_QUEUES 4
+
+// x.y into result.at(0); a single gang so the reduced value can be stored in the region
+void dot(vector & x, vector & y, vector & result, int queue = acc_async_sync)
+{
+  if(!compatible(x, y)) return;
+  if(captured(TASK_DOT, queue, NULL, &x, &result, &y)) return;
+#pragma acc parallel num_gangs(1) \
+ present(x, y, result) \
+ async(queue)
+  {
+    float sum = 0.0f;
+#pragma acc loop vector reduction(+:sum)
+    for(int i = 0; i < x.n; i++)
+      sum += x.at(i)*y.at(i);
+    result.at(0) = sum;
+  }
+  result.version++;
+}
+
+struct graph_task
+{
+  task_kind kind;
+  matrix * mat;
+  vector * x, * y, * z;
+  float a, b;
+  int queue;
+  bool waitOn[GRAPH_QUEUES];
+};
+
+struct task_graph
+{
+
+  graph_task * tasks;
+  int ntasks, capacity;
+  bool finalized;
+  bool broken;    // an operation was refused during capture, so the record is incomplete
+
+  task_graph()
+  {
+    capacity = 16;
+    tasks = new graph_task[capacity];
+    ntasks = 0;
+    finalized = false;
+    broken = false;
+  }
+
+  ~task_graph()
+  {
+    delete[] tasks;
+  }
+
+  graph_task & add(task_kind kind)
+  {
+    if(ntasks == capacity) {
+      graph_task * bigger = new graph_task[2*capacity];
+      for(int t = 0; t < ntasks; t++) bigger[t] = tasks[t];
+      delete[] tasks;
+      tasks = bigger;
+      capacity *= 2;
+    }
+    graph_task & t = tasks[ntasks++];
+    t.kind = kind;
+    t.mat = NULL; t.x = t.y = t.z = NULL;
+    t.a = t.b = 0.0f;
+    finalized = false;
+    return t;
+  }
+
+  void init(vector & y, float a)                { graph_task & t = add(TASK_INIT);  t.y = &y; t.a = a; }
+  void copy(vector & x, vector & y)             { graph_task & t = add(TASK_COPY);  t.x = &x; t.y = &y; }
+  void scal(float a, vector & y)                { graph_task & t = add(TASK_SCAL);  t.y = &y; t.a = a; }
+  void axpy(float a, vector & x, vector & y)    { graph_task & t = add(TASK_AXPY);  t.x = &x; t.y = &y; t.a = a; }
+  void axpby(float a, vector & x, float b, vector & y)
+                                                { graph_task & t = add(TASK_AXPBY); t.x = &x; t.y = &y; t.a = a; t.b = b; }
+  void dot(vector & x, vector & z, vector & result)
+                                                { graph_task & t = add(TASK_DOT);   t.x = &x; t.z = &z; t.y = &result; }
+  void matvecmul(matrix & mat, vector & x, vector & y)
+                                                { graph_task & t = add(TASK_MATVEC); t.mat = &mat; t.x = &x; t.y = &y; }
+
+  // every task writes y (mat for TASK_INIT_MATRIX); mat, x, z (and y for the updates) are read
+  void * writes(graph_task & t)
+  {
+    return t.kind == TASK_INIT_MATRIX ? (void *) t.mat : (void *) t.y;
+  }
+
+  int reads(graph_task & t, void ** objs)
+  {
+    int n = 0;
+    if(t.mat && t.kind != TASK_INIT_MATRIX) objs[n++] = t.mat;
+    if(t.x) objs[n++] = t.x;
+    if(t.z) objs[n++] = t.z;
+    if(t.kind == TASK_SCAL || t.kind == TASK_AXPY || t.kind == TASK_AXPBY) objs[n++] = t.y;
+    return n;
+  }
+
+  void finalize()
+  {
+    // per object: queue of its last writer and the queues that read it since
+    void ** objs = new void*[3*ntasks + 1];
+    int * writer = new int[3*ntasks + 1];
+    unsigned * readers = new unsigned[3*ntasks + 1];
+    int nobjs = 0;
+    int nextQueue = 0;
+
+    for(int k = 0; k < ntasks; k++) {
+      graph_task & t = tasks[k];
+      void * touched[4];
+      int nread = reads(t, touched);
+      touched[nread] = writes(t);
+
+      int slot[4];
+      for(int o = 0; o <= nread; o++) {
+        int s = 0;
+        while(s < nobjs && objs[s] != touched[o]) s++;
+        if(s == nobjs) { objs[s] = touched[o]; writer[s] = -1; readers[s] = 0; nobjs++; }
+        slot[o] = s;
+      }
+
+      unsigned deps = 0;
+      for(int o = 0; o < nread; o++)
+        if(writer[slot[o]] >= 0) deps |= 1u << writer[slot[o]];
+      int w = slot[nread];
+      if(writer[w] >= 0) deps |= 1u << writer[w];
+      deps |= readers[w];
+
+      int q = 0;
+      if(deps == 0) {
+        q = nextQueue;
+        nextQueue = (nextQueue + 1) % GRAPH_QUEUES;
+      } else {
+        while(!(deps & (1u << q))) q++;
+      }
+      t.queue = q;
+      for(int p = 0; p < GRAPH_QUEUES; p++)
+        t.waitOn[p] = p != q && (deps & (1u << p));
+
+      for(int o = 0; o < nread; o++) readers[slot[o]] |= 1u << q;
+      writer[w] = q;
+      readers[w] = 0;
+    }
+
+    delete[] objs;
+    delete[] writer;
+    delete[] readers;
+    finalized = true;
+  }
+
+  void run()
+  {
+    if(broken) {
+      std::cerr << "task graph is incomplete, an operation could not be captured" << std::endl;
+      return;
+    }
+    if(captureRefused("task_graph::run")) return;
+    if(!finalized) finalize();
+
+    for(int k = 0; k < ntasks; k++) {
+      graph_task & t = tasks[k];
+      int q = t.queue + 1;
+      for(int p = 0; p < GRAPH_QUEUES; p++)
+        if(t.waitOn[p]) acc_wait_async(p + 1, q);
+
+      switch(t.kind) {
+        case TASK_INIT:        ::init(*t.y, t.a, q); break;
+        case TASK_INIT_MATRIX: ::init(*t.mat, t.a, q); break;
+        case TASK_COPY:        ::copy(*t.x, *t.y, q); break;
+        case TASK_SCAL:        ::scal(t.a, *t.y, q); break;
+        case TASK_AXPY:        ::axpy(t.a, *t.x, *t.y, q); break;
+        case TASK_AXPBY:       ::axpby(t.a, *t.x, t.b, *t.y, q); break;
+        case TASK_DOT:         ::dot(*t.x, *t.z, *t.y, q); break;
+        case TASK_MATVEC:      ::matvecmul(*t.mat, *t.x, *t.y, q); break;
+      }
+    }
+
+    for(int p = 0; p < GRAPH_QUEUES; p++)
+      acc_wait(p + 1);
+  }
+
+};
+
+
+/**********************************************************************************************
+** Graph capture                                                                             **
+***********************************************************************************************
+** Between beginCapture(g) and endCapture(), synchronous calls to init, copy, scal, axpy,    **
+** axpby, the one-element dot and matvecmul on a plain matrix are appended to g instead of   **
+** running. Argument checks happen once, at capture time; endCapture() resolves the queues   **
+** and waits, and every g.run() afterwards replays the sequence with no per-call overhead.   **
+** g keeps pointers to the captured matrices and vectors, so they must outlive the graph:    **
+** temporaries of a function called during capture are gone before the first run().          **
+** Nothing else can be recorded: dot returning a float, updateCPU/updateGPU of any type,     **
+** the async forms, composite operations, building or training an index, the host-side       **
+** scheduler and solvers such as cg() (which also reads scalars on the host between steps)   **
+** refuse to run while capturing. They report the error before doing any work and mark g     **
+** broken, and run() on a broken graph does nothing. Capture is per thread.                  **
+**********************************************************************************************/
+thread_local task_graph * capturing = NULL;
+
+void beginCapture(task_graph & g)
+{
+  capturing = &g;
+}
+
+void endCapture()
+{
+  task_graph * g = capturing;
+  capturing = NULL;
+  if(g != NULL) g->finalize();
+}
+
+bool captureRefused(const char * op)
+{
+  if(capturing == NULL) return false;
+  std::cerr << op << " cannot be captured into a task graph" << std::endl;
+  capturing->broken = true;
+  return true;
+}
+
+bool captured(task_kind kind, int queue, matrix * mat, vector * x, vector * y, vector * z,
+              float a, float b)
+{
+  if(capturing == NULL) return false;
+  if(queue != acc_async_sync) return captureRefused("an asynchronous operation");
+  graph_task & t = capturing->add(kind);
+  t.mat = mat; t.x = x; t.y = y; t.z = z;
+  t.a = a; t.b = b;
+  return true;
+}
+
+
+/**********************************************************************************************
+** Sparse matrix (CSR) data structure                                                        **
+***********************************************************************************************
+** Compressed sparse row: the nonzeros of row i are vals[rowptr[i] : rowptr[i+1]], in the    **
+** columns cols[rowptr[i] : rowptr[i+1]]. Only nonzeros are stored and multiplied, but the   **
+** reads of vec are now gathers through cols, so their locality depends on the ordering.     **
+** Like matrix, the arrays are mirrored on the device; the struct is entered first so the    **
+** pointers inside the device copy are attached to the device arrays.                        **
+**********************************************************************************************/
+struct csr_matrix
+{
+
+  int * rowptr;
+  int * cols;
+  float * vals;
+  size_t nx, ny, nnz;
+  size_t id, version;
+
+  csr_matrix(int _nx, int _ny, int _nnz)
+  {
+    allocate(_nx, _ny, _nnz);
+  }
+
+  // the nonzeros of a dense matrix; its host copy must be current
+  csr_matrix(matrix & dense)
+  {
+    int count = 0;
+    for(int i = 0; i < dense.nx; i++)
+      for(int j = 0; j < dense.ny; j++)
+        if(dense.at(i, j) != 0.0f) count++;
+
+    allocate(dense.nx, dense.ny, count);
+
+    int k = 0;
+    for(int i = 0; i < dense.nx; i++) {
+      rowptr[i] = k;
+      for(int j = 0; j < dense.ny; j++)
+        if(dense.at(i, j) != 0.0f) {
+          cols[k] = j;
+          vals[k] = dense.at(i, j);
+          k++;
+        }
+    }
+    rowptr[nx] = k;
+    updateGPU();
+  }
+
+  ~csr_matrix()
+  {
+    #pragma acc exit data delete(rowptr, cols, vals)
+    #pragma acc exit data delete(this)
+    delete[] rowptr;
+    delete[] cols;
+    delete[] vals;
+  }
+
+  void allocate(int _nx, int _ny, int _nnz)
+  {
+    nx = _nx; ny = _ny; nnz = _nnz;
+    id = newObjectId();
+    version = 0;
+    rowptr = new int[_nx + 1];
+    cols = new int[_nnz > 0 ? _nnz : 1];
+    vals = new float[_nnz > 0 ? _nnz : 1];
+    #pragma acc enter data copyin(this)
+    #pragma acc enter data create(rowptr[:_nx+1], cols[:_nnz], vals[:_nnz])
+  }
+
+  void updateCPU()
+  {
+    if(captureRefused("csr_matrix::updateCPU")) return;
+    #pragma acc update self(rowptr[:nx+1], cols[:nnz], vals[:nnz])
+  }
+
+  void updateGPU()
+  {
+    if(captureRefused("csr_matrix::updateGPU")) return;
+    #pragma acc update device(rowptr[:nx+1], cols[:nnz], vals[:nnz])
+    version++;
+  }
+
+};
+
+void matvecmul(csr_matrix & mat, vector & vec, vector & out)
+{
+  if(captureRefused("matvecmul on a csr_matrix")) return;
+  if(mat.ny != vec.n || mat.nx != out.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  int i, k;
+  float sum;
+
+#pragma acc parallel loop gang \
+ present(mat, vec, out) \
+ private(sum)
+  for ( i = 0 ; i < mat.nx ; i++ ) {
+    sum = 0.0f;
+#pragma acc loop vector reduction(+:sum)
+    for ( k = mat.rowptr[i] ; k < mat.rowptr[i+1] ; k++ ) {
+      sum += mat.vals[k]*vec.at(mat.cols[k]);
+    }
+    out.at(i) = sum;
+  }
+
+  out.version++;
+}
+
+
+/**********************************************************************************************
+** Reordering for locality                                                                   **
+***********************************************************************************************
+** A permutation p renumbers n indices: new index i is old index p.perm[i], and              **
+** p.inverse undoes it. For a sparse matrix, numbering rows and columns so that connected    **
+** indices get nearby numbers keeps the vec.at(cols[k]) gathers of a row within a few cache  **
+** lines. Given A' = P*A*Q^T (permute(A, P, Q, A')), A*x = y is computed as                  **
+**   apply(Q, x, x'); matvecmul(A', x', y'); undo(P, y', y)                                  **
+** rcm():            reverse Cuthill-McKee, a BFS from a peripheral node that visits         **
+**                   neighbours by increasing degree; minimizes bandwidth                    **
+** partitionOrder(): grows nparts BFS regions of about n/nparts indices each from low        **
+**                   degree seeds and numbers them one region after the other, so rows of a  **
+**                   region (one thread's share of a gang loop) touch the same part of vec   **
+** Both run on the host and use the pattern of A as a graph (symmetrize it first if the      **
+** pattern is not symmetric).                                                                **
+**********************************************************************************************/
+struct permutation
+{
+
+  int * perm;
+  int * inverse;
+  size_t n;
+
+  permutation(int _n)
+  {
+    n = _n;
+    perm = new int[_n];
+    inverse = new int[_n];
+    for(int i = 0; i < _n; i++) perm[i] = inverse[i] = i;
+    #pragma acc enter data copyin(this)
+    #pragma acc enter data create(perm[:_n], inverse[:_n])
+  }
+
+  ~permutation()
+  {
+    #pragma acc exit data delete(perm, inverse)
+    #pragma acc exit data delete(this)
+    delete[] perm;
+    delete[] inverse;
+  }
+
+  // call after filling perm on the host
+  void finish()
+  {
+    if(captureRefused("permutation::finish")) return;
+    for(int i = 0; i < n; i++) inverse[perm[i]] = i;
+    #pragma acc update device(perm[:n], inverse[:n])
+  }
+
+};
+
+// out[i] = in[perm[i]]
+void apply(permutation & p, vector & in, vector & out)
+{
+  if(captureRefused("apply")) return;
+#pragma acc parallel loop \
+ present(p, in, out)
+  for(int i = 0; i < p.n; i++)
+    out.at(i) = in.at(p.perm[i]);
+  out.version++;
+}
+
+// out[perm[i]] = in[i]
+void undo(permutation & p, vector & in, vector & out)
+{
+  if(captureRefused("undo")) return;
+#pragma acc parallel loop \
+ present(p, in, out)
+  for(int i = 0; i < p.n; i++)
+    out.at(p.perm[i]) = in.at(i);
+  out.version++;
+}
+
+// B = rows*A*cols^T on the host; B must have A's dimensions and nnz
+void permute(csr_matrix & A, permutation & rows, permutation & cols, csr_matrix & B)
+{
+  if(captureRefused("permute")) return;
+  if(B.nx != A.nx || B.ny != A.ny || B.nnz != A.nnz || rows.n != A.nx || cols.n != A.ny) {
+    std::cerr << "matrix/permutation dimensions incompatible" << std::endl;
+    return;
+  }
+
+  int k = 0;
+  for(int i = 0; i < B.nx; i++) {
+    int r = rows.perm[i];
+    B.rowptr[i] = k;
+    for(int e = A.rowptr[r]; e < A.rowptr[r+1]; e++) {
+      // insertion sort keeps each row in increasing column order
+      int c = cols.inverse[A.cols[e]];
+      float v = A.vals[e];
+      int pos = k++;
+      while(pos > B.rowptr[i] && B.cols[pos-1] > c) {
+        B.cols[pos] = B.cols[pos-1];
+        B.vals[pos] = B.vals[pos-1];
+        pos--;
+      }
+      B.cols[pos] = c;
+      B.vals[pos] = v;
+    }
+  }
+  B.rowptr[B.nx] = k;
+  B.updateGPU();
+}
+
+int bandwidth(csr_matrix & A)
+{
+  int band = 0;
+  for(int i = 0; i < A.nx; i++)
+    for(int e = A.rowptr[i]; e < A.rowptr[i+1]; e++)
+      band = abs(A.cols[e] - i) > band ? abs(A.cols[e] - i) : band;
+  return band;
+}
+
+// breadth-first search from start over unvisited indices, neighbours by increasing degree.
+// appends to order and returns the index of the last level's first entry
+int bfsOrder(csr_matrix & A, int start, bool * visited, int * order, int & count)
+{
+  int head = count;
+  int levelStart = count;
+  order[count++] = start;
+  visited[start] = true;
+  int levelEnd = count;
+
+  while(head < count) {
+    if(head == levelEnd) {
+      levelStart = levelEnd;
+      levelEnd = count;
+    }
+    int v = order[head++];
+    int first = count;
+    for(int e = A.rowptr[v]; e < A.rowptr[v+1]; e++) {
+      int u = A.cols[e];
+      if(u == v || visited[u]) continue;
+      visited[u] = true;
+      // insert by degree among this node's newly found neighbours
+      int du = A.rowptr[u+1] - A.rowptr[u];
+      int pos = count++;
+      while(pos > first && A.rowptr[order[pos-1]+1] - A.rowptr[order[pos-1]] > du) {
+        order[pos] = order[pos-1];
+        pos--;
+      }
+      order[pos] = u;
+    }
+  }
+  return levelStart;
+}
+
+void rcm(csr_matrix & A, permutation & p)
+{
+  if(A.nx != A.ny || p.n != A.nx) {
+    std::cerr << "matrix/permutation dimensions incompatible" << std::endl;
+    return;
+  }
+
+  int n = A.nx;
+  bool * visited = new bool[n]();
+  bool * scratch = new bool[n];
+  int * order = new int[n];
+  int count = 0;
+
+  while(count < n) {
+    // lowest degree unvisited node, then hop to the far end of its BFS once
+    int start = -1;
+    for(int v = 0; v < n; v++)
+      if(!visited[v] && (start < 0 || A.rowptr[v+1] - A.rowptr[v] < A.rowptr[start+1] - A.rowptr[start]))
+        start = v;
+    for(int v = 0; v < n; v++) scratch[v] = visited[v];
+    int trial = count;
+    int last = bfsOrder(A, start, scratch, order, trial);
+    start = order[last];
+
+    bfsOrder(A, start, visited, order, count);
+  }
+
+  for(int i = 0; i < n; i++) p.perm[i] = order[n - 1 - i];
+  p.finish();
+
+  delete[] visited;
+  delete[] scratch;
+  delete[] order;
+}
+
+void partitionOrder(csr_matrix & A, int nparts, permutation & p)
+{
+  if(A.nx != A.ny || p.n != A.nx || nparts < 1) {
+    std::cerr << "matrix/permutation dimensions incompatible" << std::endl;
+    return;
+  }
+
+  int n = A.nx;
+  bool * visited = new bool[n]();
+  int * queue = new int[n];
+  int count = 0;
+
+  for(int part = 0; part < nparts && count < n; part++) {
+    int target = (int)((size_t)n*(part + 1)/nparts);
+    while(count < target) {
+      int seed = -1;
+      for(int v = 0; v < n; v++)
+        if(!visited[v] && (seed < 0 || A.rowptr[v+1] - A.rowptr[v] < A.rowptr[seed+1] - A.rowptr[seed]))
+          seed = v;
+      int head = count;
+      queue[count++] = seed;
+      visited[seed] = true;
+      while(head < count && count < target) {
+        int v = queue[head++];
+        for(int e = A.rowptr[v]; e < A.rowptr[v+1] && count < target; e++) {
+          int u = A.cols[e];
+          if(visited[u]) continue;
+          visited[u] = true;
+          queue[count++] = u;
+        }
+      }
+    }
+  }
+
+  for(int i = 0; i < n; i++) p.perm[i] = queue[i];
+  p.finish();
+
+  delete[] visited;
+  delete[] queue;
+}
+
+
+/**********************************************************************************************
+** Hybrid dense/sparse matrix                                                                **
+***********************************************************************************************
+** smart_matrix splits a dense matrix into blocks of SMART_BLOCK_ROWS rows, looks at the     **
+** nonzeros of each block and stores it in the format that suits it:                         **
+**   dense: at least SMART_DENSE_FILL of the block is nonzero                                **
+**   BSR:   the nonzeros cluster in BSR_SIZE x BSR_SIZE tiles that are mostly full           **
+**   SELL:  row lengths are nearly equal, so padding every row to the longest one is cheap;  **
+**          stored column-major so consecutive rows (vector lanes) read consecutive memory   **
+**   CSR:   everything else                                                                  **
+** matvecmul launches one kernel per format, covering every block of that format: the        **
+** kernels reach the blocks through their device addresses (acc_deviceptr), collected by     **
+** format in a small device array. The analysis is kept with the blocks, and build() only    **
+** redoes it when the source matrix has a new id or version.                                 **
+**********************************************************************************************/
+#define SMART_BLOCK_ROWS 64
+#define SMART_DENSE_FILL 0.4
+#define SMART_BSR_FILL 0.5
+#define SMART_SELL_PADDING 1.25
+#define BSR_SIZE 4
+
+enum block_format { FORMAT_DENSE, FORMAT_CSR, FORMAT_SELL, FORMAT_BSR };
+
+struct matrix_block
+{
+
+  block_format format;
+  int row0, rows, ny;
+  int width;   // SELL: padded row length, BSR: number of block rows
+  int nptr, nidx, nval;
+  int * ptr;   // CSR: row pointers, BSR: block row pointers
+  int * idx;   // CSR, SELL: columns, BSR: block columns
+  float * vals;
+
+  matrix_block(block_format _format, int _row0, int _rows, int _ny,
+               int _width, int _nptr, int _nidx, int _nval)
+  {
+    format = _format;
+    row0 = _row0; rows = _rows; ny = _ny;
+    width = _width;
+    nptr = _nptr; nidx = _nidx; nval = _nval;
+    ptr = new int[_nptr > 0 ? _nptr : 1];
+    idx = new int[_nidx > 0 ? _nidx : 1];
+    vals = new float[_nval > 0 ? _nval : 1];
+    #pragma acc enter data copyin(this)
+    #pragma acc enter data create(ptr[:_nptr], idx[:_nidx], vals[:_nval])
+  }
+
+  ~matrix_block()
+  {
+    #pragma acc exit data delete(ptr, idx, vals)
+    #pragma acc exit data delete(this)
+    delete[] ptr;
+    delete[] idx;
+    delete[] vals;
+  }
+
+  void updateGPU()
+  {
+    #pragma acc update device(ptr[:nptr], idx[:nidx], vals[:nval])
+  }
+
+};
+
+// picks and fills the format for rows [row0, row0+rows) of the host copy of dense
+matrix_block * analyseBlock(matrix & dense, int row0, int rows)
+{
+  int ny = dense.ny;
+  int b = BSR_SIZE;
+  int nbcols = (ny + b - 1) / b;
+  int nbrows = (rows + b - 1) / b;
+
+  int nnz = 0, longest = 0;
+  for(int r = 0; r < rows; r++) {
+    int len = 0;
+    for(int j = 0; j < ny; j++)
+      if(dense.at(row0 + r, j) != 0.0f) len++;
+    nnz += len;
+    if(len > longest) longest = len;
+  }
+
+  int tiles = 0;
+  for(int br = 0; br < nbrows; br++)
+    for(int bc = 0; bc < nbcols; bc++) {
+      bool any = false;
+      for(int r = br*b; r < br*b + b && r < rows && !any; r++)
+        for(int j = bc*b; j < bc*b + b && j < ny && !any; j++)
+          any = dense.at(row0 + r, j) != 0.0f;
+      if(any) tiles++;
+    }
+
+  matrix_block * blk;
+  if(nnz >= SMART_DENSE_FILL*rows*ny) {
+    blk = new matrix_block(FORMAT_DENSE, row0, rows, ny, 0, 0, 0, rows*ny);
+    for(int r = 0; r < rows; r++)
+      for(int j = 0; j < ny; j++)
+        blk->vals[r*ny + j] = dense.at(row0 + r, j);
+  } else if(tiles > 0 && nnz >= SMART_BSR_FILL*tiles*b*b) {
+    blk = new matrix_block(FORMAT_BSR, row0, rows, ny, nbrows, nbrows + 1, tiles, tiles*b*b);
+    int t = 0;
+    for(int br = 0; br < nbrows; br++) {
+      blk->ptr[br] = t;
+      for(int bc = 0; bc < nbcols; bc++) {
+        bool any = false;
+        for(int r = br*b; r < br*b + b && r < rows && !any; r++)
+          for(int j = bc*b; j < bc*b + b && j < ny && !any; j++)
+            any = dense.at(row0 + r, j) != 0.0f;
+        if(!any) continue;
+        blk->idx[t] = bc;
+        for(int rr = 0; rr < b; rr++)
+          for(int cc = 0; cc < b; cc++) {
+            int r = br*b + rr, j = bc*b + cc;
+            blk->vals[(t*b + rr)*b + cc] = r < rows && j < ny ? dense.at(row0 + r, j) : 0.0f;
+          }
+        t++;
+      }
+    }
+    blk->ptr[nbrows] = t;
+  } else if(longest <= SMART_SELL_PADDING*nnz/rows + 1) {
+    blk = new matrix_block(FORMAT_SELL, row0, rows, ny, longest, 0, rows*longest, rows*longest);
+    for(int r = 0; r < rows; r++) {
+      int k = 0;
+      for(int j = 0; j < ny; j++)
+        if(dense.at(row0 + r, j) != 0.0f) {
+          blk->idx[k*rows + r] = j;
+          blk->vals[k*rows + r] = dense.at(row0 + r, j);
+          k++;
+        }
+      for(; k < longest; k++) {
+        blk->idx[k*rows + r] = 0;
+        blk->vals[k*rows + r] = 0.0f;
+      }
+    }
+  } else {
+    blk = new matrix_block(FORMAT_CSR, row0, rows, ny, 0, rows + 1, nnz, nnz);
+    int k = 0;
+    for(int r = 0; r < rows; r++) {
+      blk->ptr[r] = k;
+      for(int j = 0; j < ny; j++)
+        if(dense.at(row0 + r, j) != 0.0f) {
+          blk->idx[k] = j;
+          blk->vals[k] = dense.at(row0 + r, j);
+          k++;
+        }
+    }
+    blk->ptr[rows] = k;
+  }
+
+  blk->updateGPU();
+  return blk;
+}
+
+struct smart_matrix
+{
+
+  matrix_block ** blocks;
+  matrix_block ** order;   // device addresses of the blocks, grouped by format
+  int nblocks;
+  size_t nx, ny;
+  size_t sourceId, sourceVersion;
+  int counts[4];
+  int first[5];            // order[first[f] : first[f+1]] holds the blocks of format f
+
+  smart_matrix(matrix & dense)
+  {
+    blocks = NULL;
+    order = NULL;
+    nblocks = 0;
+    nx = ny = 0;
+    sourceId = 0;
+    build(dense);
+  }
+
+  ~smart_matrix()
+  {
+    release();
+  }
+
+  void release()
+  {
+    if(order != NULL) {
+      #pragma acc exit data delete(order)
+    }
+    for(int k = 0; k < nblocks; k++) delete blocks[k];
+    delete[] blocks;
+    delete[] order;
+    blocks = NULL;
+    order = NULL;
+    nblocks = 0;
+  }
+
+  // (re)analyses dense, whose host copy must be current, unless it is unchanged since last time
+  void build(matrix & dense)
+  {
+    if(captureRefused("smart_matrix::build")) return;
+    if(blocks != NULL && sourceId == dense.id && sourceVersion == dense.version) return;
+    release();
+
+    nx = dense.nx; ny = dense.ny;
+    nblocks = (nx + SMART_BLOCK_ROWS - 1) / SMART_BLOCK_ROWS;
+    blocks = new matrix_block*[nblocks];
+    for(int f = 0; f < 4; f++) counts[f] = 0;
+    for(int k = 0; k < nblocks; k++) {
+      int row0 = k*SMART_BLOCK_ROWS;
+      int rows = nx - row0 < SMART_BLOCK_ROWS ? nx - row0 : SMART_BLOCK_ROWS;
+      blocks[k] = analyseBlock(dense, row0, rows);
+      counts[blocks[k]->format]++;
+    }
+
+    order = new matrix_block*[nblocks > 0 ? nblocks : 1];
+    first[0] = 0;
+    for(int f = 0; f < 4; f++) {
+      int n = first[f];
+      for(int k = 0; k < nblocks; k++)
+        if(blocks[k]->format == f)
+          order[n++] = (matrix_block *) acc_deviceptr(blocks[k]);
+      first[f+1] = n;
+    }
+    #pragma acc enter data copyin(order[:nblocks])
+
+    sourceId = dense.id;
+    sourceVersion = dense.version;
+  }
+
+};
+
+void matvecmul(smart_matrix & mat, vector & vec, vector & out)
+{
+  if(captureRefused("matvecmul on a smart_matrix")) return;
+  if(mat.ny != vec.n || mat.nx != out.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  matrix_block ** order = mat.order;
+  int ny = mat.ny;
+  int b, r, j, k;
+  float sum;
+
+  if(mat.counts[FORMAT_DENSE] > 0) {
+#pragma acc parallel loop gang collapse(2) \
+ present(order, vec, out) \
+ private(sum)
+    for ( b = mat.first[FORMAT_DENSE] ; b < mat.first[FORMAT_DENSE+1] ; b++ ) {
+      for ( r = 0 ; r < SMART_BLOCK_ROWS ; r++ ) {
+        matrix_block * blk = order[b];
+        if(r < blk->rows) {
+          sum = 0.0f;
+#pragma acc loop vector reduction(+:sum)
+          for ( j = 0 ; j < ny ; j++ ) {
+            sum += blk->vals[r*ny + j]*vec.at(j);
+          }
+          out.at(blk->row0 + r) = sum;
+        }
+      }
+    }
+  }
+
+  if(mat.counts[FORMAT_CSR] > 0) {
+#pragma acc parallel loop gang collapse(2) \
+ present(order, vec, out) \
+ private(sum)
+    for ( b = mat.first[FORMAT_CSR] ; b < mat.first[FORMAT_CSR+1] ; b++ ) {
+      for ( r = 0 ; r < SMART_BLOCK_ROWS ; r++ ) {
+        matrix_block * blk = order[b];
+        if(r < blk->rows) {
+          sum = 0.0f;
+#pragma acc loop vector reduction(+:sum)
+          for ( k = blk->ptr[r] ; k < blk->ptr[r+1] ; k++ ) {
+            sum += blk->vals[k]*vec.at(blk->idx[k]);
+          }
+          out.at(blk->row0 + r) = sum;
+        }
+      }
+    }
+  }
+
+  // SELL: one vector lane per row; the column-major slices make the lanes' loads contiguous
+  if(mat.counts[FORMAT_SELL] > 0) {
+#pragma acc parallel loop gang \
+ present(order, vec, out)
+    for ( b = mat.first[FORMAT_SELL] ; b < mat.first[FORMAT_SELL+1] ; b++ ) {
+#pragma acc loop vector
+      for ( r = 0 ; r < SMART_BLOCK_ROWS ; r++ ) {
+        matrix_block * blk = order[b];
+        int rows = blk->rows;
+        if(r < rows) {
+          float s = 0.0f;
+          for ( int c = 0 ; c < blk->width ; c++ ) {
+            s += blk->vals[c*rows + r]*vec.at(blk->idx[c*rows + r]);
+          }
+          out.at(blk->row0 + r) = s;
+        }
+      }
+    }
+  }
+
+  if(mat.counts[FORMAT_BSR] > 0) {
+    int bs = BSR_SIZE;
+#pragma acc parallel loop gang collapse(2) \
+ present(order, vec, out) \
+ private(sum)
+    for ( b = mat.first[FORMAT_BSR] ; b < mat.first[FORMAT_BSR+1] ; b++ ) {
+      for ( r = 0 ; r < SMART_BLOCK_ROWS ; r++ ) {
+        matrix_block * blk = order[b];
+        if(r < blk->rows) {
+          int br = r / bs, rr = r % bs;
+          sum = 0.0f;
+#pragma acc loop vector reduction(+:sum)
+          for ( k = blk->ptr[br] ; k < blk->ptr[br+1] ; k++ ) {
+            for ( int cc = 0 ; cc < bs ; cc++ ) {
+              int col = blk->idx[k]*bs + cc;
+              if(col < ny) sum += blk->vals[(k*bs + rr)*bs + cc]*vec.at(col);
+            }
+          }
+          out.at(blk->row0 + r) = sum;
+        }
+      }
+    }
+  }
+
+  out.version++;
+}
+
+
+/**********************************************************************************************
+** Diagonal and block-diagonal matrices                                                      **
+***********************************************************************************************
+** diagonal_matrix stores only its n diagonal entries; a product is one element-wise         **
+** multiply.                                                                                 **
+** block_diagonal_matrix stores its square diagonal blocks back to back, block k starting    **
+** at row/column start[k] and at vals[offset[k]]. A product is a batch of small dense        **
+** matvecs: one gang per block, one vector lane per row of the block.                        **
+**********************************************************************************************/
+struct diagonal_matrix
+{
+
+  vector d;
+  size_t nx, ny;
+
+  diagonal_matrix(int _n)
+    : d(_n)
+  {
+    nx = ny = _n;
+  }
+
+  float& at(int i)
+  {
+    return d.at(i);
+  }
+
+};
+
+void matvecmul(diagonal_matrix & mat, vector & vec, vector & out)
+{
+  if(captureRefused("matvecmul on a diagonal_matrix")) return;
+  if(mat.ny != vec.n || mat.nx != out.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  assign(out, lazy(mat.d)*lazy(vec));
+}
+
+struct block_diagonal_matrix
+{
+
+  float * vals;
+  int * start;
+  int * offset;
+  int nblocks;
+  size_t nx, ny, nvals;
+
+  // nblocks blocks of blockSize x blockSize
+  block_diagonal_matrix(int _nblocks, int blockSize)
+  {
+    int * sizes = new int[_nblocks];
+    for(int k = 0; k < _nblocks; k++) sizes[k] = blockSize;
+    allocate(_nblocks, sizes);
+    delete[] sizes;
+  }
+
+  // block k is sizes[k] x sizes[k]
+  block_diagonal_matrix(int _nblocks, const int * sizes)
+  {
+    allocate(_nblocks, sizes);
+  }
+
+  ~block_diagonal_matrix()
+  {
+    #pragma acc exit data delete(vals, start, offset)
+    #pragma acc exit data delete(this)
+    delete[] vals;
+    delete[] start;
+    delete[] offset;
+  }
+
+  void allocate(int _nblocks, const int * sizes)
+  {
+    nblocks = _nblocks;
+    start = new int[_nblocks + 1];
+    offset = new int[_nblocks + 1];
+    start[0] = offset[0] = 0;
+    for(int k = 0; k < _nblocks; k++) {
+      start[k+1] = start[k] + sizes[k];
+      offset[k+1] = offset[k] + sizes[k]*sizes[k];
+    }
+    nx = ny = start[_nblocks];
+    nvals = offset[_nblocks];
+    vals = new float[nvals];
+    #pragma acc enter data copyin(this)
+    #pragma acc enter data copyin(start[:_nblocks+1], offset[:_nblocks+1])
+    #pragma acc enter data create(vals[:nvals])
+  }
+
+  int blockSize(int k)
+  {
+    return start[k+1] - start[k];
+  }
+
+  // row r, column c of block k
+  float& at(int k, int r, int c)
+  {
+    return vals[offset[k] + r*blockSize(k) + c];
+  }
+
+  void updateCPU()
+  {
+    if(captureRefused("block_diagonal_matrix::updateCPU")) return;
+    #pragma acc update self(vals[:nvals])
+  }
+
+  void updateGPU()
+  {
+    if(captureRefused("block_diagonal_matrix::updateGPU")) return;
+    #pragma acc update device(vals[:nvals])
+  }
+
+};
+
+void matvecmul(block_diagonal_matrix & mat, vector & vec, vector & out)
+{
+  if(captureRefused("matvecmul on a block_diagonal_matrix")) return;
+  if(mat.ny != vec.n || mat.nx != out.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  int k, r, c;
+  float sum;
+
+#pragma acc parallel loop gang \
+ present(mat, vec, out)
+  for ( k = 0 ; k < mat.nblocks ; k++ ) {
+    int s = mat.start[k];
+    int size = mat.start[k+1] - s;
+    float * block = mat.vals + mat.offset[k];
+#pragma acc loop vector private(sum)
+    for ( r = 0 ; r < size ; r++ ) {
+      sum = 0.0f;
+      for ( c = 0 ; c < size ; c++ ) {
+        sum += block[r*size + c]*vec.at(s + c);
+      }
+      out.at(s + r) = sum;
+    }
+  }
+
+  out.version++;
+}
+
+
+/**********************************************************************************************
+** Masked Matrix-Vector multiply                                                             **
+***********************************************************************************************
+** matvecmul_rows() computes only the entries of out listed in a row_selection and leaves    **
+** the rest of out untouched. The selection is built once, from an index list or a mask,     **
+** as a sorted list without duplicates kept on the device, so an active set can be reused    **
+** across iterations. Rows are handed out one per gang from the compacted list, which        **
+** balances the work however the selected rows are spread, and sorting keeps neighbouring    **
+** gangs on neighbouring rows of mat.                                                        **
+**********************************************************************************************/
+struct row_selection
+{
+
+  int * rows;
+  size_t n;
+
+  // any order, duplicates allowed; entries outside [0, nx) are dropped
+  row_selection(const int * list, int count, int nx)
+  {
+    bool * mask = new bool[nx]();
+    for(int k = 0; k < count; k++)
+      if(list[k] >= 0 && list[k] < nx) mask[list[k]] = true;
+    build(mask, nx);
+    delete[] mask;
+  }
+
+  row_selection(const bool * mask, int nx)
+  {
+    build(mask, nx);
+  }
+
+  ~row_selection()
+  {
+    #pragma acc exit data delete(rows)
+    #pragma acc exit data delete(this)
+    delete[] rows;
+  }
+
+  void build(const bool * mask, int nx)
+  {
+    n = 0;
+    for(int i = 0; i < nx; i++)
+      if(mask[i]) n++;
+    rows = new int[n > 0 ? n : 1];
+    int k = 0;
+    for(int i = 0; i < nx; i++)
+      if(mask[i]) rows[k++] = i;
+    #pragma acc enter data copyin(this)
+    #pragma acc enter data copyin(rows[:n])
+  }
+
+};
+
+void matvecmul_rows(matrix & mat, vector & vec, vector & out, row_selection & sel)
+{
+  if(captureRefused("matvecmul_rows")) return;
+  if(mat.ny != vec.n || mat.nx != out.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  int k, j;
+  float sum;
+
+#pragma acc parallel loop gang \
+ present(mat, vec, out, sel) \
+ private(sum)
+  for ( k = 0 ; k < sel.n ; k++ ) {
+    int i = sel.rows[k];
+    sum = 0.0f;
+#pragma acc loop vector reduction(+:sum)
+    for ( j = 0 ; j < mat.ny ; j++ ) {
+      sum += mat.at(i,j)*vec.at(j);
+    }
+    out.at(i) = sum;
+  }
+
+  out.version++;
+}
+
+
+/**********************************************************************************************
+** Top-k Matrix-Vector multiply                                                              **
+***********************************************************************************************
+** matvecmul_topk() returns the k largest entries of mat*vec and their rows without ever     **
+** writing the full product. The rows are split into chunks, one per gang; each gang keeps   **
+** the best k scores of its chunk in a bounded min-heap (the smallest kept score at the      **
+** root, so most rows are rejected with one compare). Only the chunks*k candidates are       **
+** copied back, and the host merges them with the same heap.                                 **
+** copyout clause on a compute construct:                                                    **
+**   allocates the array on the device for the region and copies it back at the end          **
+** routine directive:                                                                        **
+**   compiles a function for the device too, so it can be called inside compute regions      **
+**********************************************************************************************/
+#define TOPK_CHUNKS 256
+
+// min-heap of at most k (score, index) pairs in score[0:count], idx[0:count]
+#pragma acc routine seq
+void heapOffer(float * score, int * idx, int & count, int k, float s, int i)
+{
+  int pos;
+  if(count < k) {
+    pos = count++;
+    while(pos > 0 && score[(pos-1)/2] > s) {
+      score[pos] = score[(pos-1)/2];
+      idx[pos] = idx[(pos-1)/2];
+      pos = (pos-1)/2;
+    }
+  } else if(s > score[0]) {
+    pos = 0;
+    while(true) {
+      int child = 2*pos + 1;
+      if(child >= k) break;
+      if(child + 1 < k && score[child+1] < score[child]) child++;
+      if(score[child] >= s) break;
+      score[pos] = score[child];
+      idx[pos] = idx[child];
+      pos = child;
+    }
+  } else {
+    return;
+  }
+  score[pos] = s;
+  idx[pos] = i;
+}
+
+// keeps the best k of n candidates (entries with idx < 0 are skipped), best first
+int topkMerge(const int * candIdx, const float * candScore, int n, int k,
+              int * indices, float * scores)
+{
+  float * best = new float[k];
+  int * bestIdx = new int[k];
+  int found = 0;
+  for(int c = 0; c < n; c++)
+    if(candIdx[c] >= 0)
+      heapOffer(best, bestIdx, found, k, candScore[c], candIdx[c]);
+
+  // popping the min-heap yields the results worst first
+  for(int r = found - 1; r >= 0; r--) {
+    scores[r] = best[0];
+    indices[r] = bestIdx[0];
+    float s = best[r];
+    int id = bestIdx[r];
+    int pos = 0;
+    while(true) {
+      int child = 2*pos + 1;
+      if(child >= r) break;
+      if(child + 1 < r && best[child+1] < best[child]) child++;
+      if(best[child] >= s) break;
+      best[pos] = best[child];
+      bestIdx[pos] = bestIdx[child];
+      pos = child;
+    }
+    best[pos] = s;
+    bestIdx[pos] = id;
+  }
+
+  delete[] best;
+  delete[] bestIdx;
+  return found;
+}
+
+// writes up to k results, best first; returns how many
+int matvecmul_topk(matrix & mat, vector & vec, int k, int * indices, float * scores)
+{
+  if(captureRefused("matvecmul_topk")) return 0;
+  if(mat.ny != vec.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return 0;
+  }
+  if(k <= 0) return 0;
+
+  int nx = mat.nx;
+  int chunks = nx < TOPK_CHUNKS ? nx : TOPK_CHUNKS;
+  int * candIdx = new int[chunks*k];
+  float * candScore = new float[chunks*k];
+  int c, i, j;
+  float sum;
+
+#pragma acc parallel loop gang \
+ present(mat, vec) \
+ copyout(candIdx[:chunks*k], candScore[:chunks*k]) \
+ private(sum)
+  for ( c = 0 ; c < chunks ; c++ ) {
+    float * score = candScore + c*k;
+    int * idx = candIdx + c*k;
+    int count = 0;
+    for ( int h = 0 ; h < k ; h++ ) idx[h] = -1;
+#pragma acc loop seq
+    for ( i = (int)((long)nx*c/chunks) ; i < (int)((long)nx*(c+1)/chunks) ; i++ ) {
+      sum = 0.0f;
+#pragma acc loop vector reduction(+:sum)
+      for ( j = 0 ; j < mat.ny ; j++ ) {
+        sum += mat.at(i,j)*vec.at(j);
+      }
+      heapOffer(score, idx, count, k, sum, i);
+    }
+  }
+
+  int found = topkMerge(candIdx, candScore, chunks*k, k, indices, scores);
+
+  delete[] candIdx;
+  delete[] candScore;
+  return found;
+}
+
+
+/**********************************************************************************************
+** Product-quantized Matrix-Vector multiply                                                  **
+***********************************************************************************************
+** For retrieval the exact product is rarely needed. pq_index splits the columns into m      **
+** subspaces and runs k-means in each one, so every row becomes m one-byte codes naming its  **
+** nearest centroid per subspace. A query first fills an m x ks table of centroid.vec dots,  **
+** after which each approximate score is m table lookups: nx*m bytes are read instead of     **
+** nx*ny floats. The top-k overload can re-score the best candidates with the exact row      **
+** kernel to recover most of the lost accuracy.                                              **
+** The index is built once, from the device copy of the matrix, and is not refreshed when    **
+** the matrix changes. The k-means assignment and update steps and the encoding of all rows  **
+** are kernels (the update sums with atomics), so the build scales with the device too.      **
+** data construct:                                                                           **
+**   keeps the training scratch arrays on the device across the kernels that share them      **
+**********************************************************************************************/
+#define PQ_TRAIN_ROWS 8192
+
+struct pq_index;
+void pqTrain(pq_index & pq, matrix & mat, int iters);
+
+struct pq_index
+{
+
+  float * codebooks;     // m x ks x dsub, the last subspace zero padded
+  unsigned char * codes; // nx x m, kept on the device
+  float * lut;           // m x ks, filled per query
+  int nx, ny, m, ks, dsub;
+
+  // trains on the device copy of mat, which must be current; ks is at most 256
+  pq_index(matrix & mat, int _m, int _ks = 256, int iters = 10)
+  {
+    nx = mat.nx;
+    ny = mat.ny;
+    m = _m < 1 ? 1 : (_m > ny ? ny : _m);
+    ks = _ks > 256 ? 256 : _ks;
+    if(ks > nx) ks = nx;
+    if(ks < 1) ks = 1;
+    dsub = (ny + m - 1) / m;
+
+    codebooks = new float[m*ks*dsub];
+    codes = new unsigned char[(long)nx*m];
+    lut = new float[m*ks];
+
+    #pragma acc enter data copyin(this)
+    #pragma acc enter data create(codebooks[:m*ks*dsub], codes[:(long)nx*m], lut[:m*ks])
+
+    pqTrain(*this, mat, iters);
+  }
+
+  ~pq_index()
+  {
+    #pragma acc exit data delete(codebooks, codes, lut)
+    #pragma acc exit data delete(this)
+    delete[] codebooks;
+    delete[] codes;
+    delete[] lut;
+  }
+
+};
+
+// closest centroid of subspace s to row i of mat, by squared distance
+#pragma acc routine seq
+int pqNearest(pq_index & pq, matrix & mat, int i, int s)
+{
+  int j0 = s*pq.dsub;
+  int width = j0 + pq.dsub > pq.ny ? pq.ny - j0 : pq.dsub;
+  const float * book = pq.codebooks + s*pq.ks*pq.dsub;
+  int best = 0;
+  float bestDist = 0.0f;
+  for(int c = 0; c < pq.ks; c++) {
+    float dist = 0.0f;
+    for(int d = 0; d < width; d++) {
+      float diff = mat.at(i, j0 + d) - book[c*pq.dsub + d];
+      dist += diff*diff;
+    }
+    if(c == 0 || dist < bestDist) {
+      best = c;
+      bestDist = dist;
+    }
+  }
+  return best;
+}
+
+// k-means per subspace over up to PQ_TRAIN_ROWS evenly spaced rows, then encodes every row
+void pqTrain(pq_index & pq, matrix & mat, int iters)
+{
+  if(captureRefused("pq_index training")) return;
+  int nx = pq.nx, m = pq.m, ks = pq.ks, dsub = pq.dsub;
+  int ntrain = nx < PQ_TRAIN_ROWS ? nx : PQ_TRAIN_ROWS;
+  int * train = new int[ntrain];
+  for(int t = 0; t < ntrain; t++) train[t] = (int)((long)nx*t/ntrain);
+  int * assign = new int[ntrain];
+  float * sums = new float[ks*dsub];
+  int * count = new int[ks];
+
+#pragma acc data copyin(train[:ntrain]) create(assign[:ntrain], sums[:ks*dsub], count[:ks])
+  {
+    for(int s = 0; s < m; s++) {
+      int j0 = s*dsub;
+      int width = j0 + dsub > pq.ny ? pq.ny - j0 : dsub;
+
+      // seed with evenly spaced training rows
+#pragma acc parallel loop collapse(2) \
+ present(pq, mat, train)
+      for(int c = 0; c < ks; c++)
+        for(int d = 0; d < dsub; d++)
+          pq.codebooks[(s*ks + c)*dsub + d] =
+            d < width ? mat.at(train[(long)ntrain*c/ks], j0 + d) : 0.0f;
+
+      for(int it = 0; it < iters; it++) {
+#pragma acc parallel loop \
+ present(pq, mat, train, assign)
+        for(int t = 0; t < ntrain; t++)
+          assign[t] = pqNearest(pq, mat, train[t], s);
+
+#pragma acc parallel loop \
+ present(sums, count)
+        for(int c = 0; c < ks; c++) {
+          count[c] = 0;
+          for(int d = 0; d < dsub; d++) sums[c*dsub + d] = 0.0f;
+        }
+
+#pragma acc parallel loop \
+ present(mat, train, assign, sums, count)
+        for(int t = 0; t < ntrain; t++) {
+          int c = assign[t];
+#pragma acc atomic update
+          count[c]++;
+          for(int d = 0; d < width; d++) {
+            float v = mat.at(train[t], j0 + d);
+#pragma acc atomic update
+            sums[c*dsub + d] += v;
+          }
+        }
+
+        // an emptied cluster keeps its old centroid
+#pragma acc parallel loop collapse(2) \
+ present(pq, sums, count)
+        for(int c = 0; c < ks; c++)
+          for(int d = 0; d < width; d++)
+            if(count[c] > 0) pq.codebooks[(s*ks + c)*dsub + d] = sums[c*dsub + d] / count[c];
+      }
+    }
+
+#pragma acc parallel loop collapse(2) \
+ present(pq, mat)
+    for(int i = 0; i < nx; i++)
+      for(int s = 0; s < m; s++)
+        pq.codes[(long)i*m + s] = (unsigned char) pqNearest(pq, mat, i, s);
+  }
+
+  delete[] train;
+  delete[] assign;
+  delete[] sums;
+  delete[] count;
+}
+
+// lut[s][c] = centroid c of subspace s dotted with the matching slice of vec
+void pqTable(pq_index & pq, vector & vec)
+{
+  int s, c, d;
+
+#pragma acc parallel loop gang \
+ present(pq, vec)
+  for ( s = 0 ; s < pq.m ; s++ ) {
+#pragma acc loop vector
+    for ( c = 0 ; c < pq.ks ; c++ ) {
+      float sum = 0.0f;
+      for ( d = 0 ; d < pq.dsub && s*pq.dsub + d < pq.ny ; d++ ) {
+        sum += pq.codebooks[(s*pq.ks + c)*pq.dsub + d]*vec.at(s*pq.dsub + d);
+      }
+      pq.lut[s*pq.ks + c] = sum;
+    }
+  }
+}
+
+// approximate out = mat*vec for the matrix the index was built from
+void matvecmul(pq_index & pq, vector & vec, vector & out)
+{
+  if(captureRefused("matvecmul on a pq_index")) return;
+  if(pq.ny != vec.n || pq.nx != out.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  pqTable(pq, vec);
+
+  int i, s;
+
+#pragma acc parallel loop gang vector \
+ present(pq, out)
+  for ( i = 0 ; i < pq.nx ; i++ ) {
+    float sum = 0.0f;
+#pragma acc loop seq
+    for ( s = 0 ; s < pq.m ; s++ ) {
+      sum += pq.lut[s*pq.ks + pq.codes[(long)i*pq.m + s]];
+    }
+    out.at(i) = sum;
+  }
+
+  out.version++;
+}
+
+// top-k by approximate score, chunked as in matvecmul_topk
+int matvecmul_topk(pq_index & pq, vector & vec, int k, int * indices, float * scores)
+{
+  if(captureRefused("matvecmul_topk")) return 0;
+  if(pq.ny != vec.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return 0;
+  }
+  if(k <= 0) return 0;
+
+  pqTable(pq, vec);
+
+  int nx = pq.nx;
+  int chunks = nx < TOPK_CHUNKS ? nx : TOPK_CHUNKS;
+  int * candIdx = new int[chunks*k];
+  float * candScore = new float[chunks*k];
+  int c, i, s;
+  float sum;
+
+#pragma acc parallel loop gang \
+ present(pq) \
+ copyout(candIdx[:chunks*k], candScore[:chunks*k]) \
+ private(sum)
+  for ( c = 0 ; c < chunks ; c++ ) {
+    float * score = candScore + c*k;
+    int * idx = candIdx + c*k;
+    int count = 0;
+    for ( int h = 0 ; h < k ; h++ ) idx[h] = -1;
+#pragma acc loop seq
+    for ( i = (int)((long)nx*c/chunks) ; i < (int)((long)nx*(c+1)/chunks) ; i++ ) {
+      sum = 0.0f;
+#pragma acc loop vector reduction(+:sum)
+      for ( s = 0 ; s < pq.m ; s++ ) {
+        sum += pq.lut[s*pq.ks + pq.codes[(long)i*pq.m + s]];
+      }
+      heapOffer(score, idx, count, k, sum, i);
+    }
+  }
+
+  int found = topkMerge(candIdx, candScore, chunks*k, k, indices, scores);
+
+  delete[] candIdx;
+  delete[] candScore;
+  return found;
+}
+
+// approximate top-rerank candidates, re-scored exactly against mat; returns up to k
+int matvecmul_topk(pq_index & pq, matrix & mat, vector & vec, int k, int rerank,
+                   int * indices, float * scores)
+{
+  if(captureRefused("matvecmul_topk")) return 0;
+  if(mat.nx != pq.nx || mat.ny != pq.ny) {
+    std::cerr << "matrix/index dimensions incompatible" << std::endl;
+    return 0;
+  }
+  if(k <= 0) return 0;
+  if(rerank < k) rerank = k;
+
+  int * cand = new int[rerank];
+  float * exact = new float[rerank];
+  int n = matvecmul_topk(pq, vec, rerank, cand, exact);
+  int r, j;
+  float sum;
+
+#pragma acc parallel loop gang \
+ present(mat, vec) \
+ copyin(cand[:n]) copyout(exact[:n]) \
+ private(sum)
+  for ( r = 0 ; r < n ; r++ ) {
+    int i = cand[r];
+    sum = 0.0f;
+#pragma acc loop vector reduction(+:sum)
+    for ( j = 0 ; j < mat.ny ; j++ ) {
+      sum += mat.at(i,j)*vec.at(j);
+    }
+    exact[r] = sum;
+  }
+
+  int found = topkMerge(cand, exact, n, k, indices, scores);
+
+  delete[] cand;
+  delete[] exact;
+  return found;
+}
+
+
+/**********************************************************************************************
+** Randomized sketching operators                                                            **
+***********************************************************************************************
+** A sketch S (d x n, d << n) shrinks the rows of a tall matrix or the length of a vector    **
+** while roughly preserving norms, so a least-squares problem can be solved at size d.       **
+** None of the three below stores S:                                                         **
+**   countsketch      - row i is added, with a random sign, into one random output row;      **
+**                      the cost is one pass over the nonzeros                               **
+**   srht             - random signs, a fast Walsh-Hadamard transform, then d sampled rows   **
+**   gaussian_sketch  - i.i.d. N(0, 1/d) entries regenerated inside the kernel by hashing    **
+**                      (seed, r, i), so every launch sees the same S                        **
+** Vectors go through matvecmul(S, x, y), matrices through sketch(S, A, SA).                 **
+** atomic update directive:                                                                  **
+**   makes the following read-modify-write indivisible, needed when rows collide             **
+**********************************************************************************************/
+
+#pragma acc routine seq
+unsigned int sketchHash(unsigned int seed, unsigned int a, unsigned int b)
+{
+  unsigned int h = seed + 0x9E3779B9u*(a + 1);
+  h ^= h >> 16; h *= 0x85EBCA6Bu; h ^= h >> 13; h *= 0xC2B2AE35u; h ^= h >> 16;
+  h += 0x9E3779B9u*(b + 1);
+  h ^= h >> 16; h *= 0x85EBCA6Bu; h ^= h >> 13; h *= 0xC2B2AE35u; h ^= h >> 16;
+  return h;
+}
+
+#pragma acc routine seq
+float sketchSign(unsigned int seed, unsigned int i)
+{
+  return (sketchHash(seed, 0, i) & 1) ? 1.0f : -1.0f;
+}
+
+#pragma acc routine seq
+float sketchGaussian(unsigned int seed, unsigned int r, unsigned int i)
+{
+  // Box-Muller on two uniforms in (0, 1]
+  float u1 = ((sketchHash(seed, r, 2*i) >> 8) + 1) * (1.0f/16777216.0f);
+  float u2 = ((sketchHash(seed, r, 2*i + 1) >> 8) + 1) * (1.0f/16777216.0f);
+  return sqrtf(-2.0f*logf(u1))*cosf(6.28318531f*u2);
+}
+
+struct countsketch
+{
+
+  int n, d;
+  unsigned int seed;
+
+  countsketch(int _n, int _d, unsigned int _seed)
+  {
+    n = _n; d = _d; seed = _seed;
+  }
+
+  #pragma acc routine seq
+  int bucket(int i)
+  {
+    return sketchHash(seed, 1, i) % d;
+  }
+
+};
+
+void matvecmul(countsketch & S, vector & x, vector & y)
+{
+  if(captureRefused("matvecmul on a countsketch")) return;
+  if(S.n != x.n || S.d != y.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  init(y, 0.0f);
+
+#pragma acc parallel loop \
+ copyin(S) present(x, y)
+  for(int i = 0; i < S.n; i++) {
+    float v = sketchSign(S.seed, i)*x.at(i);
+#pragma acc atomic update
+    y.at(S.bucket(i)) += v;
+  }
+
+  y.version++;
+}
+
+void sketch(countsketch & S, matrix & A, matrix & SA)
+{
+  if(captureRefused("sketch")) return;
+  if(S.n != A.nx || S.d != SA.nx || A.ny != SA.ny) {
+    std::cerr << "matrix/matrix dimensions incompatible" << std::endl;
+    return;
+  }
+
+  init(SA, 0.0f);
+
+#pragma acc parallel loop collapse(2) \
+ copyin(S) present(A, SA)
+  for(int i = 0; i < A.nx; i++)
+    for(int j = 0; j < A.ny; j++) {
+      float v = sketchSign(S.seed, i)*A.at(i, j);
+#pragma acc atomic update
+      SA.at(S.bucket(i), j) += v;
+    }
+
+  SA.version++;
+}
+
+// only the stored nonzeros are touched
+void sketch(countsketch & S, csr_matrix & A, matrix & SA)
+{
+  if(captureRefused("sketch")) return;
+  if(S.n != A.nx || S.d != SA.nx || A.ny != SA.ny) {
+    std::cerr << "matrix/matrix dimensions incompatible" << std::endl;
+    return;
+  }
+
+  init(SA, 0.0f);
+
+#pragma acc parallel loop gang \
+ copyin(S) present(A, SA)
+  for(int i = 0; i < A.nx; i++) {
+    int r = S.bucket(i);
+    float s = sketchSign(S.seed, i);
+#pragma acc loop vector
+    for(int k = A.rowptr[i]; k < A.rowptr[i+1]; k++) {
+#pragma acc atomic update
+      SA.at(r, A.cols[k]) += s*A.vals[k];
+    }
+  }
+
+  SA.version++;
+}
+
+struct srht
+{
+
+  int n, d, np;
+  unsigned int seed;
+  int * rows;   // d distinct rows of the transformed, zero-padded input
+  vector work;  // np, for vector sketches
+
+  srht(int _n, int _d, unsigned int _seed)
+    : work(pow2(_n))
+  {
+    n = _n; seed = _seed;
+    np = pow2(_n);
+    d = _d > np ? np : _d;
+
+    // partial Fisher-Yates over 0..np-1
+    int * perm = new int[np];
+    for(int i = 0; i < np; i++) perm[i] = i;
+    for(int r = 0; r < d; r++) {
+      int pick = r + sketchHash(seed, 2, r) % (np - r);
+      int t = perm[r]; perm[r] = perm[pick]; perm[pick] = t;
+    }
+    rows = new int[d];
+    memcpy(rows, perm, d*sizeof(int));
+    delete[] perm;
+
+    #pragma acc enter data copyin(this)
+    #pragma acc enter data copyin(rows[:d])
+  }
+
+  ~srht()
+  {
+    #pragma acc exit data delete(rows)
+    #pragma acc exit data delete(this)
+    delete[] rows;
+  }
+
+  static int pow2(int n)
+  {
+    int p = 1;
+    while(p < n) p *= 2;
+    return p;
+  }
+
+};
+
+// in-place unnormalized Walsh-Hadamard transform down each of the ny columns of w
+void fwht(matrix & w)
+{
+  if(captureRefused("fwht")) return;
+  int m = w.nx;
+
+  for(int half = 1; half < m; half *= 2) {
+#pragma acc parallel loop collapse(2) \
+ present(w)
+    for(int k = 0; k < m/2; k++)
+      for(int j = 0; j < w.ny; j++) {
+        int a = (k / half)*2*half + k % half;
+        int b = a + half;
+        float u = w.at(a, j), v = w.at(b, j);
+        w.at(a, j) = u + v;
+        w.at(b, j) = u - v;
+      }
+  }
+
+  w.version++;
+}
+
+void fwht(vector & w)
+{
+  if(captureRefused("fwht")) return;
+  int m = w.n;
+
+  for(int half = 1; half < m; half *= 2) {
+#pragma acc parallel loop \
+ present(w)
+    for(int k = 0; k < m/2; k++) {
+      int a = (k / half)*2*half + k % half;
+      int b = a + half;
+      float u = w.at(a), v = w.at(b);
+      w.at(a) = u + v;
+      w.at(b) = u - v;
+    }
+  }
+
+  w.version++;
+}
+
+// y = sqrt(np/d) * rows of (H/sqrt(np)) D x
+void matvecmul(srht & S, vector & x, vector & y)
+{
+  if(captureRefused("matvecmul on an srht")) return;
+  if(S.n != x.n || S.d != y.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  vector & w = S.work;
+  float scale = 1.0f/sqrtf(S.d);
+
+#pragma acc parallel loop \
+ present(x, w)
+  for(int i = 0; i < S.np; i++)
+    w.at(i) = i < S.n ? sketchSign(S.seed, i)*x.at(i) : 0.0f;
+
+  fwht(w);
+
+#pragma acc parallel loop \
+ present(S, w, y)
+  for(int r = 0; r < S.d; r++)
+    y.at(r) = scale*w.at(S.rows[r]);
+
+  y.version++;
+}
+
+void sketch(srht & S, matrix & A, matrix & SA)
+{
+  if(captureRefused("sketch")) return;
+  if(S.n != A.nx || S.d != SA.nx || A.ny != SA.ny) {
+    std::cerr << "matrix/matrix dimensions incompatible" << std::endl;
+    return;
+  }
+
+  matrix w(S.np, A.ny);
+  float scale = 1.0f/sqrtf(S.d);
+
+#pragma acc parallel loop collapse(2) \
+ present(A, w)
+  for(int i = 0; i < S.np; i++)
+    for(int j = 0; j < A.ny; j++)
+      w.at(i, j) = i < S.n ? sketchSign(S.seed, i)*A.at(i, j) : 0.0f;
+
+  fwht(w);
+
+#pragma acc parallel loop collapse(2) \
+ present(S, w, SA)
+  for(int r = 0; r < S.d; r++)
+    for(int j = 0; j < A.ny; j++)
+      SA.at(r, j) = scale*w.at(S.rows[r], j);
+
+  SA.version++;
+}
+
+struct gaussian_sketch
+{
+
+  int n, d;
+  unsigned int seed;
+
+  gaussian_sketch(int _n, int _d, unsigned int _seed)
+  {
+    n = _n; d = _d; seed = _seed;
+  }
+
+};
+
+void matvecmul(gaussian_sketch & S, vector & x, vector & y)
+{
+  if(captureRefused("matvecmul on a gaussian_sketch")) return;
+  if(S.n != x.n || S.d != y.n) {
+    std::cerr << "matrix/vector dimensions incompatible" << std::endl;
+    return;
+  }
+
+  float scale = 1.0f/sqrtf(S.d);
+  float sum;
+
+#pragma acc parallel loop gang \
+ copyin(S) present(x, y) \
+ private(sum)
+  for(int r = 0; r < S.d; r++) {
+    sum = 0.0f;
+#pragma acc loop vector reduction(+:sum)
+    for(int i = 0; i < S.n; i++)
+      sum += sketchGaussian(S.seed, r, i)*x.at(i);
+    y.at(r) = scale*sum;
+  }
+
+  y.version++;
+}
+
+// each entry of S is generated once per launch and reused across the row of A
+void sketch(gaussian_sketch & S, matrix & A, matrix & SA)
+{
+  if(captureRefused("sketch")) return;
+  if(S.n != A.nx || S.d != SA.nx || A.ny != SA.ny) {
+    std::cerr << "matrix/matrix dimensions incompatible" << std::endl;
+    return;
+  }
+
+  init(SA, 0.0f);
+  float scale = 1.0f/sqrtf(S.d);
+
+#pragma acc parallel loop gang \
+ copyin(S) present(A, SA)
+  for(int r = 0; r < S.d; r++) {
+#pragma acc loop seq
+    for(int i = 0; i < S.n; i++) {
+      float g = scale*sketchGaussian(S.seed, r, i);
+#pragma acc loop vector
+      for(int j = 0; j < A.ny; j++)
+        SA.at(r, j) += g*A.at(i, j);
+    }
+  }
+
+  SA.version++;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// Automated correctness checking                                                            //
+///////////////////////////////////////////////////////////////////////////////////////////////
+void check(matrix & mat, const char * name, const char * filename,
+           const char * functionname, int linenum)
+{
+#ifdef DEBUG
+  mat.updateCPU();
+  pgi_compare(mat.data, "float", mat.nx*mat.ny, name, filename, functionname, linenum);
+#endif
+}
+
+void check(vector & vec, const char * name, const char * filename,
+           const char * functionname, int linenum)
+{
+#ifdef DEBUG
+  vec.updateCPU();
+  pgi_compare(vec.data, "float", vec.n, name, filename, functionname, linenum);
+#endif
+}
+
+// compares got with a reference, usually a plain matvecmul, on the host; tol is relative to
+// the largest entry of ref. got is also handed to check() under the same line number
+int mismatches = 0;
+
+void compare(vector & got, vector & ref, const char * name, int linenum, float tol = 1e-4f)
+{
+  got.updateCPU();
+  ref.updateCPU();
+  float err = 0.0f, scale = 0.0f;
+  for(int i = 0; i < ref.n && i < got.n; i++) {
+    err = fmaxf(err, fabsf(got.at(i) - ref.at(i)));
+    scale = fmaxf(scale, fabsf(ref.at(i)));
+  }
+  if(got.n != ref.n || err > tol*fmaxf(scale, 1.0f)) {
+    std::cerr << name << " differs from the reference (check " << linenum << ", error "
+              << err << ")" << std::endl;
+    mismatches++;
+  }
+  check(got, name, "OpenACCExample.cpp", "main", linenum);
+}
+
+// dense host copy of any operator with at(i, j), for the references below
+template <class M>
+void densify(M & op, matrix & dense)
+{
+  for(int i = 0; i < dense.nx; i++)
+    for(int j = 0; j < dense.ny; j++)
+      dense.at(i, j) = op.at(i, j);
+  dense.updateGPU();
+}
+
+// dense form of a stencil: row i holds the weights of the in-grid neighbours of point i
+void densify(stencil_operator & op, matrix & dense)
+{
+  for(int i = 0; i < dense.nx; i++)
+    for(int j = 0; j < dense.ny; j++)
+      dense.at(i, j) = 0.0f;
+  for(int z = 0; z < op.gz; z++)
+    for(int y = 0; y < op.gy; y++)
+      for(int x = 0; x < op.gx; x++)
+        for(int dz = -1; dz <= 1; dz++)
+          for(int dy = -1; dy <= 1; dy++)
+            for(int dx = -1; dx <= 1; dx++) {
+              int xx = x + dx, yy = y + dy, zz = z + dz;
+              if(xx < 0 || xx >= op.gx || yy < 0 || yy >= op.gy || zz < 0 || zz >= op.gz)
+                continue;
+              dense.at((z*op.gy + y)*op.gx + x, (zz*op.gy + yy)*op.gx + xx) =
+                op.weight(dx, dy, dz);
+            }
+  dense.updateGPU();
+}
+
+// entry (i, j) of the matrix that the multi-rank checks in main split across the ranks
+float distEntry(int i, int j)
+{
+  return i == j ? 8.0f : 0.25f*((3*i + 5*j) % 11) - 1.0f;
+}
+
+void * socketServer(void * arg);
+void * ringServer(void * arg);
+
+
+/**********************************************************************************************
+** Main                                                                                      **
+***********************************************************************************************
+** Important steps:                                                                          **
+**   Device-aware memory allocation                                                          **
+**   Device computation                                                                      **
+**   Correctness testing                                                                     **
+**********************************************************************************************/
+int main()
+{
+
+  // distributed products on 4 forked ranks. They run first because a device context does
+  // not survive fork. The ranks gather their blocks of out and rank 0 checks the whole vector
+  {
+    const int nd = 64;
+    shm_communicator world(4, 4*nd), processRow0(2, 2*nd), processRow1(2, 2*nd);
+    int rank = world.spawn();
+
+    dist_matrix D(world, nd, nd);
+    for(size_t i = D.row0; i < D.row0 + D.local.nx; i++)
+      for(int j = 0; j < nd; j++)
+        D.at(i, j) = distEntry(i, j);
+    D.local.updateGPU();
+    vector xd(D.col1 - D.col0), yd(D.local.nx), distOut(nd);
+    for(size_t j = D.col0; j < D.col1; j++) xd.at(j - D.col0) = cosf(0.3f*j);
+    xd.updateGPU();
+    matvecmul(D, xd, yd, world);
+    yd.updateCPU();
+    world.allgatherBegin(yd.data, yd.n, D.row0);
+    world.allgatherEnd(distOut.data, nd);
+
+    // 2x2 grid: rank (p, q) joins the communicator of process row p as its rank q. The
+    // ranks of column 0 place their rows in a zero vector, which a sum over all ranks fills
+    shm_communicator & rowComm = rank / 2 == 0 ? processRow0 : processRow1;
+    rowComm.attach(rank % 2);
+    grid_matrix GD(nd, nd, 2, 2, rank, 8);
+    for(int i = 0; i < nd; i++)
+      for(int j = 0; j < nd; j++)
+        if(GD.owns(i, j)) GD.at(i, j) = distEntry(i, j);
+    GD.local.updateGPU();
+    vector xg(GD.local.ny), yg(GD.local.nx), placed(nd), gridOut(nd);
+    for(size_t l = 0; l < xg.n; l++) xg.at(l) = cosf(0.3f*cyclicGlobal(l, 8, 2, GD.q));
+    xg.updateGPU();
+    matvecmul(GD, xg, yg, rowComm);
+    yg.updateCPU();
+    for(int i = 0; i < nd; i++) placed.at(i) = 0.0f;
+    if(GD.q == 0)
+      for(size_t l = 0; l < yg.n; l++) placed.at(cyclicGlobal(l, 8, 2, GD.p)) = yg.at(l);
+    world.allreduceBegin(placed.data, nd);
+    world.allreduceEnd(gridOut.data, nd);
+    world.join();
+
+    matrix AD(nd, nd);
+    vector xs(nd), refd(nd);
+    for(int i = 0; i < nd; i++) {
+      for(int j = 0; j < nd; j++) AD.at(i, j) = distEntry(i, j);
+      xs.at(i) = cosf(0.3f*i);
+    }
+    AD.updateGPU(); xs.updateGPU();
+    matvecmul(AD, xs, refd);
+    distOut.updateGPU();
+    compare(distOut, refd, "dist_matrix (4 ranks)", 53);
+    gridOut.updateGPU();
+    compare(gridOut, refd, "grid_matrix (2x2 ranks)", 54);
+  }
+
+  matrix mat(128, 256);
+  vector vec(256);
+  vector out(128);
+
+  init(mat, 1.0f);
+  init(vec, 2.0f);
+
+  matvecmul(mat, vec, out);
+
+  check(mat, "mat", "OpenACCExample.cpp", "main", 1);
+  check(vec, "vec", "OpenACCExample.cpp", "main", 2);
+  check(out, "out", "OpenACCExample.cpp", "main", 3);
+
+  mat.updateCPU();
+  mat.modify(5, 0) = 3.0f;
+  matvecmul_incremental(mat, vec, out);
+
+  vector full(128);
+  matvecmul(mat, vec, full);
+  compare(out, full, "out", 4);
+
+  // vec changes as well as a row, so the incremental product must redo every row
+  matvecmul(mat, vec, out);
+  vec.updateCPU();
+  vec.at(7) = -1.0f;
+  vec.updateGPU();
+  mat.updateCPU();
+  mat.modify(9, 1) = 2.0f;
+  matvecmul_incremental(mat, vec, out);
+  matvecmul(mat, vec, full);
+  compare(out, full, "matvecmul_incremental after vec changed", 56);
+
+  // the remaining operations, each checked against matvecmul on a dense equivalent
+  const int n = 64;
+  matrix A(n, n);
+  vector x(n), y(n), ref(n), got(n);
+  for(int i = 0; i < n; i++) {
+    for(int j = 0; j < n; j++)
+      A.at(i, j) = i == j ? 4.0f : ((i + 2*j) % 7 == 0 ? 0.5f + (i*j) % 5 : 0.0f);
+    x.at(i) = cosf(0.3f*i);
+    y.at(i) = sinf(0.7f*i);
+  }
+  A.updateGPU(); x.updateGPU(); y.updateGPU();
+  matvecmul(A, x, ref);
+
+  // version counters and the result cache
+  matvec_cache cache;
+  matvecmul_cached(cache, A, x, got);
+  matvecmul_cached(cache, A, x, got);
+  compare(got, ref, "matvecmul_cached", 5);
+
+  // lazy expressions: A*(2x + y) fused and materialized
+  vector t(n), expected(n);
+  assign(t, 2.0f*lazy(x) + lazy(y));
+  matvecmul(A, t, expected);
+  matvecmul(A, 2.0f*lazy(x) + lazy(y), got);
+  compare(got, expected, "matvecmul of an expression", 6);
+
+  // level-1 kernels: A*(2x + y) again, through copy/scal/axpy
+  copy(x, t);
+  scal(2.0f, t);
+  axpy(1.0f, y, t);
+  matvecmul(A, t, got);
+  compare(got, expected, "copy/scal/axpy", 7);
+
+  // gemm: (A*B)*x against A*(B*x)
+  matrix B(n, n), C(n, n);
+  for(int i = 0; i < n; i++)
+    for(int j = 0; j < n; j++)
+      B.at(i, j) = (i - j) % 3 == 0 ? 1.0f : -0.25f;
+  B.updateGPU();
+  init(C, 0.0f);
+  gemm(1.0f, A, B, 0.0f, C);
+  matvecmul(B, x, t);
+  matvecmul(A, t, expected);
+  matvecmul(C, x, got);
+  compare(got, expected, "gemm", 8);
+
+  // gemm with no dimension a multiple of the tile, C = 1.5*A*B + 0.5*C, against a double
+  // precision reference computed on the host
+  {
+    matrix GA(37, 45), GB(45, 29), GC(37, 29);
+    vector gc(37*29), gref(37*29);
+    for(int i = 0; i < 37; i++)
+      for(int k = 0; k < 45; k++) GA.at(i, k) = sinf(0.3f*i + 0.7f*k);
+    for(int k = 0; k < 45; k++)
+      for(int j = 0; j < 29; j++) GB.at(k, j) = cosf(0.2f*k - 0.5f*j);
+    for(int i = 0; i < 37; i++)
+      for(int j = 0; j < 29; j++) {
+        GC.at(i, j) = 0.1f*(i - j);
+        double sum = 0.0;
+        for(int k = 0; k < 45; k++) sum += (double)GA.at(i, k)*GB.at(k, j);
+        gref.at(i*29 + j) = (float)(1.5*sum + 0.5*GC.at(i, j));
+      }
+    GA.updateGPU(); GB.updateGPU(); GC.updateGPU(); gref.updateGPU();
+    gemm(1.5f, GA, GB, 0.5f, GC);
+    GC.updateCPU();
+    for(int i = 0; i < 37; i++)
+      for(int j = 0; j < 29; j++) gc.at(i*29 + j) = GC.at(i, j);
+    gc.updateGPU();
+    compare(gc, gref, "gemm (37x45 by 45x29)", 55);
+  }
+
+  // ger and matvecmul_ger: (A + x*y^T)*v = A*v + (y.v)*x, with v = x
+  matrix G(n, n);
+  gemm(1.0f, A, B, 0.0f, G);    // any matrix; G = A*B
+  matvecmul(G, x, expected);
+  axpy(dot(y, x), x, expected);
+  ger(1.0f, x, y, G);
+  matvecmul(G, x, got);
+  compare(got, expected, "ger", 9);
+  matvecmul(G, x, expected);
+  matvecmul_ger(G, x, got, 1.0f, x, y);
+  compare(got, expected, "matvecmul_ger", 10);
+
+  // syrk: (A*A^T)*x against A*(A^T*x)
+  matrix At(n, n);
+  for(int i = 0; i < n; i++)
+    for(int j = 0; j < n; j++)
+      At.at(i, j) = A.at(j, i);
+  At.updateGPU();
+  init(C, 0.0f);
+  syrk(1.0f, A, 0.0f, C);
+  matvecmul(At, x, t);
+  matvecmul(A, t, expected);
+  matvecmul(C, x, got);
+  compare(got, expected, "syrk", 11);
+
+  // low-rank: rsvd of an exactly rank-4 matrix reproduces its products
+  matrix U0(n, 4), V0(4, n), R4(n, n);
+  for(int i = 0; i < n; i++)
+    for(int k = 0; k < 4; k++) {
+      U0.at(i, k) = cosf(0.1f*i*(k + 1));
+      V0.at(k, i) = sinf(0.2f*i + k);
+    }
+  U0.updateGPU(); V0.updateGPU();
+  init(R4, 0.0f);
+  gemm(1.0f, U0, V0, 0.0f, R4);
+  lowrank_matrix L(n, n, 8);
+  rsvd(R4, L);
+  matvecmul(R4, x, expected);
+  matvecmul(L, x, got);
+  compare(got, expected, "lowrank_matrix", 12, 1e-3f);
+
+  // Kronecker product of an 8x8 and an 8x8 factor, against the formed product
+  matrix K1(8, 8), K2(8, 8), KD(n, n);
+  for(int i = 0; i < 8; i++)
+    for(int j = 0; j < 8; j++) {
+      K1.at(i, j) = (i + j) % 4 - 1.5f;
+      K2.at(i, j) = i == j ? 2.0f : 0.1f*(i - j);
+    }
+  K1.updateGPU(); K2.updateGPU();
+  for(int i = 0; i < n; i++)
+    for(int j = 0; j < n; j++)
+      KD.at(i, j) = K1.at(i / 8, j / 8)*K2.at(i % 8, j % 8);
+  KD.updateGPU();
+  kron_operator K;
+  K.addFactor(K1);
+  K.addFactor(K2);
+  matvecmul(KD, x, expected);
+  matvecmul(K, x, got);
+  compare(got, expected, "kron_operator", 13);
+
+  // stencil: 1D Laplacian against its dense tridiagonal form, then cg on it
+  stencil_operator S(n);
+  S.laplacian();
+  matrix SD(n, n);
+  for(int i = 0; i < n; i++)
+    for(int j = 0; j < n; j++)
+      SD.at(i, j) = i == j ? 2.0f : (abs(i - j) == 1 ? -1.0f : 0.0f);
+  SD.updateGPU();
+  matvecmul(SD, x, expected);
+  matvecmul(S, x, got);
+  compare(got, expected, "stencil_operator", 14);
+  init(t, 0.0f);
+  cg(S, x, t, 4*n, 1e-6f);
+  matvecmul(SD, t, got);
+  compare(got, x, "cg", 15, 1e-3f);
+
+  // 3D grids: the 7-point Laplacian and a 27-point box stencil, each against its dense
+  // form and then solved with cg on the operator itself
+  for(int box = 0; box < 2; box++) {
+    stencil_operator S3(6, 5, 4);
+    S3.laplacian();
+    if(box) {
+      for(int k = 0; k < 27; k++) S3.w[k] = -1.0f;
+      S3.weight(0, 0, 0) = 27.0f;
+    }
+    matrix S3D(S3.nx, S3.ny);
+    densify(S3, S3D);
+    vector xs(S3.ny), bs(S3.nx), es(S3.nx), ys(S3.nx);
+    for(int i = 0; i < xs.n; i++) xs.at(i) = cosf(0.17f*i);
+    xs.updateGPU();
+    matvecmul(S3D, xs, es);
+    matvecmul(S3, xs, ys);
+    compare(ys, es, box ? "stencil_operator (27-point)" : "stencil_operator (3D)", 49 + 2*box);
+    init(bs, 0.0f);
+    cg(S3, xs, bs, 4*xs.n, 1e-6f);
+    matvecmul(S3D, bs, ys);
+    compare(ys, xs, box ? "cg (27-point)" : "cg (3D)", 50 + 2*box, 1e-3f);
+  }
+
+  // Toeplitz and circulant matrices small enough for the direct kernel
+  toeplitz_matrix T(n, n);
+  for(int k = 0; k < T.t.n; k++) T.t.at(k) = 1.0f/(1 + abs(k - n + 1));
+  T.t.updateGPU();
+  matrix TD(n, n);
+  densify(T, TD);
+  matvecmul(TD, x, expected);
+  matvecmul(T, x, got);
+  compare(got, expected, "toeplitz_matrix", 16);
+  circulant_matrix Z(n);
+  for(int k = 0; k < n; k++) Z.c.at(k) = (k % 5) - 2.0f;
+  Z.c.updateGPU();
+  densify(Z, TD);
+  matvecmul(TD, x, expected);
+  matvecmul(Z, x, got);
+  compare(got, expected, "circulant_matrix", 17);
+
+  // sizes large enough for the FFT paths: a Toeplitz matrix whose padded length is not its
+  // own size, a power-of-two circulant (cyclic FFTs) and one of any other size (Toeplitz
+  // FFTs). t and c are then changed and the products redone, so the cached spectra must be
+  // refreshed
+  {
+    toeplitz_matrix TF(1000, 503);
+    circulant_matrix ZP(1024), ZN(1000);
+    vector xf(1024), yf(1024), ef(1024);
+    for(int j = 0; j < 1024; j++) xf.at(j) = cosf(0.01f*j) + (j % 3)*0.1f;
+    for(int pass = 0; pass < 2; pass++) {
+      for(int k = 0; k < TF.t.n; k++) TF.t.at(k) = sinf(0.05f*k + pass) + 0.5f;
+      for(int k = 0; k < 1024; k++) ZP.c.at(k) = pass == 0 ? (k % 7) - 3.0f : cosf(0.1f*k);
+      for(int k = 0; k < 1000; k++) ZN.c.at(k) = pass == 0 ? 1.0f/(1 + k) : (k % 4) - 1.5f;
+      TF.t.updateGPU(); ZP.c.updateGPU(); ZN.c.updateGPU();
+
+      vector xt(503), yt(1000), et(1000);
+      for(int j = 0; j < 503; j++) xt.at(j) = xf.at(j);
+      xt.updateGPU();
+      matrix TFD(1000, 503);
+      densify(TF, TFD);
+      matvecmul(TFD, xt, et);
+      matvecmul(TF, xt, yt);
+      compare(yt, et, "toeplitz_matrix (FFT)", 39 + 3*pass);
+
+      xf.updateGPU();
+      matrix ZD(1024, 1024);
+      densify(ZP, ZD);
+      matvecmul(ZD, xf, ef);
+      matvecmul(ZP, xf, yf);
+      compare(yf, ef, "circulant_matrix (cyclic FFT)", 40 + 3*pass);
+
+      vector xn(1000), yn(1000), en(1000);
+      for(int j = 0; j < 1000; j++) xn.at(j) = xf.at(j);
+      xn.updateGPU();
+      matrix ZND(1000, 1000);
+      densify(ZN, ZND);
+      matvecmul(ZND, xn, en);
+      matvecmul(ZN, xn, yn);
+      compare(yn, en, "circulant_matrix (Toeplitz FFT)", 41 + 3*pass);
+    }
+  }
+
+  // row-partitioned product on a single rank, so no processes are forked
+  shm_communicator comm(1, n);
+  comm.spawn();
+  dist_matrix D(comm, n, n);
+  densify(A, D.local);
+  matvecmul(D, x, got, comm);
+  compare(got, ref, "dist_matrix", 18);
+  comm.join();
+
+  // 2D block-cyclic product on a 1x1 grid
+  shm_communicator gridComm(1, n);
+  gridComm.spawn();
+  grid_matrix GR(n, n, 1, 1, 0, 16);
+  densify(A, GR.local);
+  matvecmul(GR, x, got, gridComm);
+  compare(got, ref, "grid_matrix", 19);
+  gridComm.join();
+
+  // batched products and the request-coalescing service
+  matrix X(2, n), Y(2, n);
+  for(int j = 0; j < n; j++) {
+    X.at(0, j) = y.at(j);
+    X.at(1, j) = x.at(j);
+  }
+  X.updateGPU();
+  matvecmul_batch(A, X, Y, 2);
+  Y.updateCPU();
+  for(int i = 0; i < n; i++) got.at(i) = Y.at(1, i);
+  got.updateGPU();
+  compare(got, ref, "matvecmul_batch", 20);
+  matvec_service service(A, 4, 1e-3);
+  service.submit(x.data, got.data);
+  service.stop();
+  got.updateGPU();
+  compare(got, ref, "matvec_service", 21);
+
+  // one round trip through the Unix socket front end, then a shutdown that joins everything
+  {
+    const char * path = "/tmp/matvecmul_check.sock";
+    matvec_service socketService(A, 4, 1e-3);
+    matvec_socket server(socketService);
+    void * serverArgs[2] = { &server, (void *) path };
+    pthread_t thread;
+    pthread_create(&thread, NULL, socketServer, serverArgs);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = -1;
+    for(int attempt = 0; attempt < 1000 && fd < 0; attempt++) {
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        fd = -1;
+        usleep(1000);
+      }
+    }
+    init(got, 0.0f);
+    got.updateCPU();
+    if(fd < 0 || !writeFull(fd, x.data, sizeof(float)*n) || !readFull(fd, got.data, sizeof(float)*n))
+      std::cerr << "no reply from the matvec socket" << std::endl;
+    got.updateGPU();
+    compare(got, ref, "serveUnixSocket", 58);
+
+    server.stop();
+    pthread_join(thread, NULL);
+    if(fd >= 0) close(fd);
+    socketService.stop();
+  }
+
+  // shared-memory ring served by a second thread
+  shm_ring ring("/matvecmul_check_ring", 2, n, n);
+  volatile bool stopRing = false;
+  void * ringArgs[3] = { &ring, &A, (void *) &stopRing };
+  pthread_t server;
+  pthread_create(&server, NULL, ringServer, ringArgs);
+  int slot;
+  memcpy(ring.acquire(slot), x.data, sizeof(float)*n);
+  memcpy(got.data, ring.call(slot), sizeof(float)*n);
+  ring.release(slot);
+  stopRing = true;
+  futexWake(&ring.hdr->posted);
+  pthread_join(server, NULL);
+  got.updateGPU();
+  compare(got, ref, "shm_ring", 22);
+
+  // core scheduler, once on data only written on the device: it must fetch the host copies
+  matvec_scheduler scheduler(2);
+  scheduler.run(A, x, got);
+  compare(got, ref, "matvec_scheduler", 23);
+  init(t, 0.5f);
+  matvecmul(A, t, expected);
+  scheduler.run(A, t, got);
+  compare(got, expected, "matvec_scheduler on device data", 57);
+
+  // async queue, then a coroutine pipeline when built as C++20
+  matvecmul(A, x, got, 1);
+  acc_wait(1);
+  compare(got, ref, "matvecmul on a queue", 24);
+#ifdef HAVE_COROUTINES
+  acc_loop loop;
+  init(got, 0.0f);
+  matvecmul_pipeline(loop, A, x, got, 2);
+  loop.run();
+  got.updateGPU();
+  compare(got, ref, "matvecmul_pipeline", 25);
+#endif
+
+  // recorded task graph
+  task_graph recorded;
+  recorded.init(got, 0.0f);
+  recorded.matvecmul(A, x, got);
+  recorded.run();
+  compare(got, ref, "task_graph", 26);
+
+  // the same sequence captured from plain calls
+  task_graph capturedGraph;
+  beginCapture(capturedGraph);
+  init(got, 0.0f);
+  matvecmul(A, x, got);
+  endCapture();
+  capturedGraph.run();
+  compare(got, ref, "graph capture", 27);
+
+  // CSR, and CSR reordered by RCM: undo(P*A*P^T * apply(x)) = A*x
+  csr_matrix CS(A);
+  matvecmul(CS, x, got);
+  compare(got, ref, "csr_matrix", 28);
+  permutation P(n);
+  rcm(CS, P);
+  csr_matrix CP(n, n, CS.nnz);
+  permute(CS, P, P, CP);
+  apply(P, x, t);
+  matvecmul(CP, t, expected);
+  undo(P, expected, got);
+  compare(got, ref, "rcm", 29);
+
+  // the same through a 4-part partition ordering
+  permutation PP(n);
+  partitionOrder(CS, 4, PP);
+  permute(CS, PP, PP, CP);
+  apply(PP, x, t);
+  matvecmul(CP, t, expected);
+  undo(PP, expected, got);
+  compare(got, ref, "partitionOrder", 59);
+
+  // a tridiagonal matrix with its indices shuffled by i -> 37i mod n: rcm must bring the
+  // bandwidth back down, and the reordered product must still match
+  {
+    matrix W(n, n);
+    for(int i = 0; i < n; i++)
+      for(int j = 0; j < n; j++)
+        W.at(i, j) = 0.0f;
+    for(int i = 0; i < n; i++)
+      for(int j = i - 1; j <= i + 1; j++)
+        if(j >= 0 && j < n) W.at(37*i % n, 37*j % n) = i == j ? 2.0f : -1.0f;
+    W.updateGPU();
+    csr_matrix CW(W), CWR(n, n, CW.nnz);
+    permutation PW(n);
+    rcm(CW, PW);
+    permute(CW, PW, PW, CWR);
+    if(bandwidth(CWR) >= bandwidth(CW)) {
+      std::cerr << "rcm left the bandwidth at " << bandwidth(CWR) << " (was "
+                << bandwidth(CW) << ")" << std::endl;
+      mismatches++;
+    }
+    matvecmul(W, x, expected);
+    apply(PW, x, t);
+    vector yw(n);
+    matvecmul(CWR, t, yw);
+    undo(PW, yw, got);
+    compare(got, expected, "rcm on a shuffled band", 60);
+  }
+
+  // per-block formats
+  smart_matrix SM(A);
+  matvecmul(SM, x, got);
+  compare(got, ref, "smart_matrix", 30);
+
+  // one block of each format, the last one partial: a full block, full 4x4 tiles on the
+  // diagonal, rows of very different lengths and eight rows of three scattered nonzeros
+  {
+    matrix M(200, 150);
+    vector xm(150), ym(200), em(200);
+    for(int i = 0; i < 200; i++)
+      for(int j = 0; j < 150; j++) {
+        bool nonzero;
+        if(i < 64)       nonzero = true;
+        else if(i < 128) nonzero = (i - 64)/BSR_SIZE == j/BSR_SIZE;
+        else if(i < 192) nonzero = i % 16 == 0 ? j % 3 == 0 : j == (7*i) % 150;
+        else             nonzero = j == (11*i) % 150 || j == (11*i + 50) % 150 ||
+                                   j == (11*i + 100) % 150;
+        M.at(i, j) = nonzero ? 1.0f + (i + 3*j) % 5 : 0.0f;
+      }
+    for(int j = 0; j < 150; j++) xm.at(j) = sinf(0.2f*j);
+    M.updateGPU(); xm.updateGPU();
+    smart_matrix SMM(M);
+    for(int f = 0; f < 4; f++)
+      if(SMM.counts[f] != 1) {
+        std::cerr << "smart_matrix chose format " << f << " for " << SMM.counts[f]
+                  << " blocks instead of 1" << std::endl;
+        mismatches++;
+      }
+    matvecmul(M, xm, em);
+    matvecmul(SMM, xm, ym);
+    compare(ym, em, "smart_matrix (mixed formats)", 45);
+  }
+
+  // diagonal and block-diagonal
+  diagonal_matrix DG(n);
+  block_diagonal_matrix BD(8, 8);
+  for(int i = 0; i < n; i++) DG.at(i) = 1.0f + i;
+  for(int k = 0; k < 8; k++)
+    for(int r = 0; r < 8; r++)
+      for(int c = 0; c < 8; c++)
+        BD.at(k, r, c) = A.at(8*k + r, 8*k + c);
+  DG.d.updateGPU();
+  BD.updateGPU();
+  matrix DD(n, n);
+  for(int i = 0; i < n; i++)
+    for(int j = 0; j < n; j++)
+      DD.at(i, j) = i == j ? 1.0f + i : 0.0f;
+  DD.updateGPU();
+  matvecmul(DD, x, expected);
+  matvecmul(DG, x, got);
+  compare(got, expected, "diagonal_matrix", 31);
+  for(int i = 0; i < n; i++)
+    for(int j = 0; j < n; j++)
+      DD.at(i, j) = i / 8 == j / 8 ? A.at(i, j) : 0.0f;
+  DD.updateGPU();
+  matvecmul(DD, x, expected);
+  matvecmul(BD, x, got);
+  compare(got, expected, "block_diagonal_matrix", 32);
+
+  // masked rows: every third row computed, the others left at zero
+  int list[n];
+  int nlist = 0;
+  for(int i = 0; i < n; i += 3) list[nlist++] = i;
+  row_selection sel(list, nlist, n);
+  ref.updateCPU();
+  for(int i = 0; i < n; i++) expected.at(i) = i % 3 == 0 ? ref.at(i) : 0.0f;
+  expected.updateGPU();
+  init(got, 0.0f);
+  matvecmul_rows(A, x, got, sel);
+  compare(got, expected, "matvecmul_rows", 33);
+
+  // top-k: the scores are scattered into their rows and compared with the full product
+  // restricted to the rows scoring at least the k-th score
+  int idx[8];
+  float score[8];
+  int found = matvecmul_topk(A, x, 8, idx, score);
+  float kth = found == 8 ? score[7] : 1e30f;
+  for(int i = 0; i < n; i++) expected.at(i) = ref.at(i) >= kth ? ref.at(i) : 0.0f;
+  for(int i = 0; i < n; i++) got.at(i) = 0.0f;
+  for(int k = 0; k < found; k++) got.at(idx[k]) = score[k];
+  expected.updateGPU();
+  got.updateGPU();
+  compare(got, expected, "matvecmul_topk", 34);
+
+  // the PQ index re-ranking every row must give the exact top-k
+  pq_index PQ(A, 16, 32);
+  found = matvecmul_topk(PQ, A, x, 8, n, idx, score);
+  kth = found == 8 ? score[7] : 1e30f;
+  for(int i = 0; i < n; i++) expected.at(i) = ref.at(i) >= kth ? ref.at(i) : 0.0f;
+  for(int i = 0; i < n; i++) got.at(i) = 0.0f;
+  for(int k = 0; k < found; k++) got.at(idx[k]) = score[k];
+  expected.updateGPU();
+  got.updateGPU();
+  compare(got, expected, "pq_index re-ranked", 35);
+
+  // a 3000-row index with 2-column subspaces: the approximate product must be within 5% of
+  // the largest exact score, its top-k must agree with it, and re-ranking 100 candidates
+  // must recover at least 9 of the exact top 10
+  {
+    const int nq = 3000, dq = 32;
+    matrix Q(nq, dq);
+    vector xq(dq), exact(nq), approx(nq), picked(nq), top(nq);
+    for(int i = 0; i < nq; i++)
+      for(int j = 0; j < dq; j++)
+        Q.at(i, j) = sinf(0.37f*j*(1 + (i*7919 % 1000)/1000.0f) + (i*104729 % 997)*0.0063f);
+    for(int j = 0; j < dq; j++) xq.at(j) = cosf(0.5f*j);
+    Q.updateGPU(); xq.updateGPU();
+    pq_index PQL(Q, dq/2);
+    matvecmul(Q, xq, exact);
+    matvecmul(PQL, xq, approx);
+    compare(approx, exact, "matvecmul on a pq_index", 46, 0.05f);
+
+    int qidx[10], eidx[10];
+    float qscore[10], escore[10];
+    approx.updateCPU();
+    found = matvecmul_topk(PQL, xq, 10, qidx, qscore);
+    kth = found == 10 ? qscore[9] : 1e30f;
+    for(int i = 0; i < nq; i++) top.at(i) = approx.at(i) >= kth ? approx.at(i) : 0.0f;
+    for(int i = 0; i < nq; i++) picked.at(i) = 0.0f;
+    for(int k = 0; k < found; k++) picked.at(qidx[k]) = qscore[k];
+    top.updateGPU();
+    picked.updateGPU();
+    compare(picked, top, "matvecmul_topk on a pq_index", 47);
+
+    matvecmul_topk(Q, xq, 10, eidx, escore);
+    found = matvecmul_topk(PQL, Q, xq, 10, 100, qidx, qscore);
+    int hits = 0;
+    for(int a = 0; a < 10; a++)
+      for(int b = 0; b < found; b++)
+        if(eidx[a] == qidx[b]) hits++;
+    if(hits < 9) {
+      std::cerr << "pq_index re-ranking found " << hits << " of the top 10 (check 48)" << std::endl;
+      mismatches++;
+    }
+  }
+
+  // sketches are linear: (S*A)*x = S*(A*x)
+  countsketch CSK(n, 16, 7);
+  srht SRH(n, 16, 7);
+  gaussian_sketch GSK(n, 16, 7);
+  matrix SA(16, n);
+  vector sx(16), sref(16);
+  sketch(CSK, A, SA);
+  matvecmul(SA, x, sx);
+  matvecmul(CSK, ref, sref);
+  compare(sx, sref, "countsketch", 36);
+  sketch(SRH, A, SA);
+  matvecmul(SA, x, sx);
+  matvecmul(SRH, ref, sref);
+  compare(sx, sref, "srht", 37);
+  sketch(GSK, A, SA);
+  matvecmul(SA, x, sx);
+  matvecmul(GSK, ref, sref);
+  compare(sx, sref, "gaussian_sketch", 38);
+
+  return mismatches > 0 ? 1 : 0;
+}
+
+void * socketServer(void * arg)
+{
+  void ** args = (void **) arg;
+  serveUnixSocket(*(matvec_socket *) args[0], (const char *) args[1]);
+  return NULL;
+}
+
+void * ringServer(void * arg)
+{
+  void ** args = (void **) arg;
+  serveRing(*(shm_ring *) args[0], *(matrix *) args[1], (volatile bool *) args[2]);
+  return NULL;
+}